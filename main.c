@@ -1,33 +1,396 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <sqlite3.h>
 
 #define DB_NAME "atm.db"
+#define MEMORY_DB_URI "file:/atm?vfs=memdb"
+#define RECONCILE_CHUNK 100000
+#define MINI_STATEMENT_SIZE 5
+#define DEDUPE_SLOTS 4096
+#define DEDUPE_WINDOW (24 * 60 * 60)
+#define CHANGELOG_RETENTION (7 * 24 * 60 * 60)
+#define MAINTENANCE_SECONDS 300
+
+#define ACCRUAL_CHUNK 512
+#define SCHEDULER_BATCH 256
+#define OWNER_SEARCH_LIMIT 50
+#define OWNER_FUZZY_TERMS 32
+#define OWNER_FUZZY_CANDIDATES 200
+#define OWNER_TERM_MAX 48
+
+#define STANDBY_PATH "atm-standby.db"
+#define STANDBY_BATCH 1000
+#define STANDBY_REPORT_SECONDS 5
+#define STANDBY_PROMOTE_WAIT_MS 5000
+
+#define TX_ERROR -1
+#define TX_DECLINED 0
+#define TX_OK 1
+#define TX_BLOCKED 2
+#define TX_INVALID 3
+
+#define CARD_LOCK_STRIPES 1024
+
+#define ADMIT_CRITICAL 0
+#define ADMIT_CUSTOMER 1
+#define ADMIT_BATCH 2
+#define ADMIT_PRIORITIES 3
+#define ADMISSION_RATE 20000
+#define ADMISSION_BURST 1000
+#define ADMISSION_QUEUE 64
+#define ADMISSION_WAIT_MS 250
+#define ADMISSION_REPORT_SECONDS 10
+
+#define CDC_MAX_SUBSCRIBERS 32
+#define CDC_VALUE_SIZE 128
+#define CDC_CHECKPOINT_PAGES 1000
+
+#define BACKUP_STEP_PAGES 64
+#define BACKUP_PAUSE_MS 5
+#define BACKUP_REPORT_STEPS 1000
+
+#define PIN_HASH_SIZE 128
+#define PIN_SALT_SIZE 16
+#define PIN_HASH_ITERATIONS 10000
+#define PIN_CACHE_SLOTS 4
+#define PIN_CACHE_SECONDS 300
+#define PIN_RESULT_NONE 0
+#define PIN_RESULT_FAILED 1
+#define PIN_RESULT_OK 2
+#define PIN_MIGRATE_BATCH 64
+#define PIN_MAX_ATTEMPTS 3
+
+#define ARCHIVE_DIR "archive"
+#define ARCHIVE_BATCH 5000
+#define ARCHIVE_KEEP_DAYS 400
+
+#define OFFLINE_MAGIC 0x4f464c4e
+#define OFFLINE_WITHDRAW 1
+#define OFFLINE_DEPOSIT 2
+#define OFFLINE_BLOCK 3
+#define OFFLINE_WITHDRAW_LIMIT 100.0
+#define OFFLINE_SNAPSHOT_MAX_AGE (24 * 60 * 60)
+#define OFFLINE_PIN_CHECK_MASK 0x3ff
+#define OFFLINE_REPLAY_BATCH 256
+
+#define FRAUD_RULES_FILE "fraud_rules.conf"
+#define FRAUD_SLOTS 16384
+#define FRAUD_WINDOWS 3
+#define FRAUD_MAX_RULES 32
+#define FRAUD_COUNT 0
+#define FRAUD_AMOUNT 1
+#define FRAUD_TERMINALS 2
+#define FRAUD_ALLOW 0
+#define FRAUD_DECLINE 1
+#define FRAUD_BLOCK 2
+
+#define SOCKET_PATH "atm.sock"
+#define PROTO_HEADER_SIZE 16
+#define PROTO_RESPONSE_SIZE 20
+#define PROTO_MAX_FRAME 64
+#define PROTO_BUFFER_SIZE 4096
+#define SERVER_TERMINAL_BASE 0x10000
+#define REACTOR_EVENTS 256
+#define PIN_WORKERS_MAX 16
+
+#define AUDIT_DIR "audit"
+#define AUDIT_MAGIC 0x41554431
+#define AUDIT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define AUDIT_SYNC_EVERY 256
+#define AUDIT_AUTH 1
+#define AUDIT_WITHDRAW 2
+#define AUDIT_DEPOSIT 3
+#define AUDIT_PIN_CHANGE 4
+#define AUDIT_BLOCK 5
+#define AUDIT_UNBLOCK 6
+#define AUDIT_TRANSFER 7
+
+#define BENCH_FIRST_CARD 1000000
+#define BENCH_CARDS 1000
+#define BENCH_PIN 2580
+#define BENCH_PIN_ITERATIONS 1
+
+#define OP_AUTH 1
+#define OP_BALANCE 2
+#define OP_WITHDRAW 3
+#define OP_DEPOSIT 4
+#define OP_PIN_CHANGE 5
+#define OP_EJECT 6
+#define OP_TRANSFER 7
+
+#define STATUS_OK 0
+#define STATUS_DECLINED 1
+#define STATUS_BAD_PIN 2
+#define STATUS_BLOCKED 3
+#define STATUS_NOT_AUTHENTICATED 4
+#define STATUS_INVALID 5
+#define STATUS_ERROR 6
+#define STATUS_PENDING -1
 
 typedef struct {
     int id;
-    int pin;
+    char pinHash[PIN_HASH_SIZE];
     double balance;
     int blocked;
     char ownerName[50];
+    int failedAttempts;
 } Card;
 
+typedef struct {
+    long long terminalId;
+    double deposits;
+    double withdrawals;
+    long count; // 0 marks a free slot
+} TerminalTotals;
+
+// Per-terminal totals live in an open-addressing table keyed by the terminal id,
+// since ids are whatever terminals send (u16 on the wire, per connection otherwise).
+typedef struct {
+    long cards;
+    long transactions;
+    long discrepancies;
+    int failed;
+    TerminalTotals *terminals;
+    size_t terminalSlots;
+    size_t terminalCount;
+} ReconcileResult;
+
+typedef struct {
+    int id;
+    int cardId;
+    int terminalId;
+    char type[20];
+    double amount;
+    double oldBalance;
+    double newBalance;
+    long long timestamp;
+} Transaction;
+
+typedef struct {
+    long long timestamp;
+    int id;
+} StatementCursor;
+
+typedef struct {
+    long long cards;
+    long long blockedCards;
+    double totalBalance;
+    double deposits;
+    double withdrawals;
+} CardStats;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    int32_t *ids;
+    int64_t *balancePence;
+    uint8_t *blocked;
+    uint32_t *nameIds;
+    char *names;
+    size_t namesUsed;
+    size_t namesCapacity;
+    uint64_t *nameOffsets; // Into names, which can pass 4 GiB
+    uint32_t nameCount;
+    uint32_t *nameSlots;
+    size_t nameSlotCount;
+} CardColumns;
+
+typedef struct {
+    int waiting[ADMIT_PRIORITIES];
+    int peakWaiting[ADMIT_PRIORITIES];
+    long admitted[ADMIT_PRIORITIES];
+    long shed[ADMIT_PRIORITIES];
+} AdmissionStats;
+
+typedef struct {
+    uint8_t op;
+    uint32_t cardId;
+    uint64_t requestId;
+    uint16_t terminalId;
+    uint16_t pin;
+    int64_t amountPence;
+    uint32_t toCardId;
+    const uint8_t *payload;
+    uint32_t payloadLength;
+} RequestView;
+
+typedef enum {
+    SESSION_CARD_ENTRY,
+    SESSION_PIN_ENTRY,
+    SESSION_MENU
+} SessionState;
+
+typedef struct {
+    int cardId;
+    time_t expires;
+    uint8_t digest[32];
+} PinCacheEntry;
+
+typedef struct {
+    PinCacheEntry entries[PIN_CACHE_SLOTS];
+    long hits;
+    long misses;
+} PinCache;
+
+// deferPins makes PIN checks and PIN changes that need the slow hash return
+// STATUS_PENDING instead of hashing; the caller runs the step elsewhere, stores
+// the outcome in pinResult and hands the same request back.
+typedef struct {
+    SessionState state;
+    Card card;
+    int terminalId;
+    PinCache pins;
+    int deferPins;
+    int pinResult;
+} TerminalSession;
+
+typedef struct TerminalConnection TerminalConnection;
+
+typedef struct {
+    pthread_mutex_t lock;
+    TerminalConnection *done;
+    int eventFd;
+} PinCompletions;
+
+struct TerminalConnection {
+    int fd;
+    TerminalSession session;
+    uint8_t input[PROTO_BUFFER_SIZE];
+    size_t inputUsed;
+    uint8_t output[(PROTO_BUFFER_SIZE / (4 + PROTO_HEADER_SIZE) + 1) * (4 + PROTO_RESPONSE_SIZE)];
+    size_t outputUsed;
+    size_t outputSent;
+    PinCompletions *pinCompletions;
+    TerminalConnection *pinNext;
+};
+
+// terminalId is the process's own terminal (ATM_TERMINAL_ID for a console, 0 for the
+// scheduler). Server threads act for many terminals and set sessionTerminal around
+// each request, which takes precedence while it is non-zero.
+int terminalId = 1;
+_Thread_local int sessionTerminal = 0;
+int nextConnectionTerminal = SERVER_TERMINAL_BASE;
+
+int currentTerminal();
+sqlite3 *dbReader();
+sqlite3 *dbWriterAcquire();
+sqlite3 *dbWriterAcquirePriority(int priority);
+void setDatabasePath(const char *path);
+int admissionEnter(int priority);
+void admissionLeave();
+void admissionSnapshot(AdmissionStats *stats);
+void printAdmissionStats();
+void setWriterPriority(int priority);
+void dbWriterRelease();
+void closeDatabasePool();
+void cdcAttach(sqlite3 *db);
+int cdcOpen(const char *socketPath, const char *filePath);
+int runCdcTail(const char *socketPath);
+int databaseAvailable();
+int offlineSaveSnapshot(const char *dir);
+int offlineFetchCard(const char *dir, int cardId, Card *card);
+int offlineVerifyPin(const char *dir, int cardId, int pin);
+int offlineRecord(const char *dir, int op, int cardId, double amount);
+double offlineWithdrawn(const char *dir, int cardId);
+int offlinePending(const char *dir);
+int offlineReplay(const char *dir);
+void handleOfflineTransaction(Card *card, const char *dir);
+uint32_t crc32(const void *data, size_t length);
+int auditOpen(const char *dir);
+void auditClose();
+void auditEvent(int cardId, int op, double amount, double balance, int result);
+int dumpAuditLog(const char *dir);
+void createSchema(sqlite3 *db);
 void initializeDatabase();
 int fetchCard(int cardId, Card *card);
 void updateBalance(int cardId, double newBalance);
 void updatePin(int cardId, int newPin);
+int storePin(int cardId, int newPin, char *pinHash);
+void pbkdf2Sha256(const void *password, size_t passwordLength, const uint8_t *salt, size_t saltLength,
+                  int iterations, uint8_t key[32]);
+int hashPin(int pin, int iterations, char *pinHash);
+int isLegacyPin(const char *pinHash);
+int verifyPin(PinCache *cache, int cardId, const char *pinHash, int pin);
+int checkPin(PinCache *cache, Card *card, int pin);
+long migratePins(int threads);
 void blockCard(int cardId);
+int recordFailedPin(Card *card);
+int acceptPin(Card *card);
 void contactBank(int cardId);
+int unblockCard(int cardId, const char *name);
 void handleTransaction(Card *card);
 void showMenu();
 int withdrawMoney(Card *card, double amount);
+int transferMoney(Card *card, int toId, double amount);
 int depositMoney(Card *card, double amount);
 void printReceipt(Card *card, const char *transactionType, double amount, double oldBalance);
+void printReceiptEntry(const char *transactionType, double amount, double oldBalance, double newBalance);
+int fetchMiniStatement(int cardId, StatementCursor *cursor, Transaction *transactions, int max);
+void showMiniStatement(Card *card);
 int wantsReceipt();
 int isWeakPin(int pin);
 int isValidPin(int pin);
+void insertTransaction(sqlite3 *db, int cardId, const char *transactionType, double amount, double oldBalance, double newBalance);
+void recordTransaction(int cardId, const char *transactionType, double amount, double oldBalance, double newBalance);
+long long newRequestId();
+int loadFraudRules(const char *path);
+int scoreWithdrawal(int cardId, double amount, int terminal);
+void recordWithdrawalFeatures(int cardId, double amount, int terminal);
+int processCashRequest(Card *card, const char *transactionType, double amount, long long requestId, double *oldBalance);
+void lockCards(int firstId, int secondId);
+void unlockCards(int firstId, int secondId);
+int transferFunds(Card *from, int toId, double amount, long long requestId, double *oldBalance);
+int runReconciliation(int threads);
+int parseRequest(const uint8_t *buffer, size_t length, RequestView *request);
+size_t encodeResponse(uint8_t *buffer, const RequestView *request, int status, double balance);
+int sessionHandleRequest(TerminalSession *session, const RequestView *request);
+int runTerminalServer(const char *socketPath, int threads);
+int runBenchmark(int sessions);
+int runStandby(const char *standbyPath, int intervalMs);
+int promoteStandby(const char *standbyPath);
+int runAccrual(const char *jobName, double ratePercent, int threads);
+int addStandingOrder(int fromId, int toId, double amount, int intervalSeconds, long long firstRun);
+void cancelStandingOrder(int orderId);
+int runScheduler(int tickSeconds);
+int runMaintenance(long long now);
+void maintainIfDue();
+int searchOwners(const char *query, int fuzzy, int *cardIds, int max);
+int runOwnerSearch(const char *query, int fuzzy);
+int fetchCardStats(CardStats *stats);
+int runStats(int top);
+int cardColumnsLoad(CardColumns *columns);
+void cardColumnsFree(CardColumns *columns);
+const char *cardColumnsName(const CardColumns *columns, size_t index);
+int64_t cardColumnsSumBalances(const CardColumns *columns);
+size_t cardColumnsCountBlocked(const CardColumns *columns);
+int runCardScan();
+int verifyBackup(const char *path);
+int runBackup(const char *destPath, int pagesPerStep, int pauseMs);
+long long archiveLedger(const char *dir, long long cutoff);
+int runArchive(const char *dir, int keepDays);
+int runTests(int count, char *names[]);
 void test_withdrawMoney();
 void test_depositMoney();
 void test_check_balance();
@@ -37,210 +400,5834 @@ void test_unblockCard();
 void test_fetchCard();
 void test_isWeakPin();
 void test_isValidPin();
+void test_fetchMiniStatement();
+void test_processCashRequest();
+void test_parseRequest();
+void test_scoreWithdrawal();
+void test_auditEvent();
+void test_transferFunds();
+void test_dispatchDueOrders();
+void test_searchOwners();
+void test_fetchCardStats();
+void test_cardColumns();
+void test_admissionEnter();
+void test_standbyCatchUp();
+void test_runBackup();
+void test_cdcOpen();
+void test_offlineReplay();
+void test_archiveLedger();
+void test_verifyPin();
+void test_recordFailedPin();
+void test_migrateBaseline();
+void test_terminalTotals();
+void test_runMaintenance();
 
-void initializeDatabase() {
-    sqlite3 *db;
-    char *errMsg = 0;
+// Connection pool. Every thread lazily opens its own read-only connection, so
+// reads never contend on a shared handle; all mutations go through the single
+// writer connection under writerLock. Connections are opened with NOMUTEX because
+// each one is only ever used by one thread at a time. In WAL mode the readers keep
+// working while the writer commits.
+sqlite3 *writerDb = NULL;
+const char *dbPath = DB_NAME;
+pthread_mutex_t writerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t readerKey;
+pthread_once_t readerKeyOnce = PTHREAD_ONCE_INIT;
 
-    if (sqlite3_open(DB_NAME, &db) != SQLITE_OK) {
-        printf("Error opening database.\n");
-        return;
+static void closeReader(void *db) {
+    sqlite3_close(db);
+}
+
+static void createReaderKey() {
+    pthread_key_create(&readerKey, closeReader);
+}
+
+sqlite3 *dbReader() {
+    pthread_once(&readerKeyOnce, createReaderKey);
+    sqlite3 *db = pthread_getspecific(readerKey);
+
+    if (db == NULL) {
+        if (sqlite3_open_v2(dbPath, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI, 0) != SQLITE_OK) {
+            sqlite3_close(db);
+            return NULL;
+        }
+        sqlite3_busy_timeout(db, 5000);
+        pthread_setspecific(readerKey, db);
     }
+    return db;
+}
 
-    const char *sql = "CREATE TABLE IF NOT EXISTS ATM_Cards ("
-                      "id INTEGER PRIMARY KEY, "
-                      "pin INTEGER, "
-                      "balance REAL, "
-                      "blocked INTEGER, "
-                      "ownerName TEXT);";
+// Admission control in front of the writer. Every writer acquisition first takes a
+// token from a bucket refilled at ATM_ADMIT_RATE per second (0 disables the rate
+// limit), then waits its turn in a priority queue, so under overload mutations are
+// ordered by priority rather than by whoever wins writerLock. Customer requests
+// queue for at most ADMISSION_WAIT_MS behind a bounded queue and are shed after
+// that; batch work only runs while the bucket is at least half full, so it defers
+// to customers instead of being shed. Blocking a card is never delayed by either.
+static pthread_mutex_t admissionLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admissionReady;
+static pthread_once_t admissionOnce = PTHREAD_ONCE_INIT;
+static double admissionRate = ADMISSION_RATE;
+static double admissionTokens = ADMISSION_BURST;
+static double admissionRefilledAt;
+static int admissionBusy = 0;
+static AdmissionStats admission;
+static _Thread_local int writerPriority = ADMIT_CUSTOMER;
 
-    if (sqlite3_exec(db, sql, 0, 0, &errMsg) != SQLITE_OK) {
-        printf("SQL Error: %s\n", errMsg);
-        sqlite3_free(errMsg);
+static double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void initAdmission() {
+    pthread_condattr_t attributes;
+    const char *rate = getenv("ATM_ADMIT_RATE");
+
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&admissionReady, &attributes);
+    pthread_condattr_destroy(&attributes);
+    if (rate != NULL) {
+        admissionRate = atof(rate);
     }
+    admissionRefilledAt = monotonicSeconds();
+}
 
-    sqlite3_close(db);
+void setWriterPriority(int priority) {
+    writerPriority = priority;
 }
 
-int fetchCard(int cardId, Card *card) {
-    sqlite3 *db;
-    sqlite3_stmt *stmt;
-    int found = 0;
+int admissionEnter(int priority) {
+    pthread_once(&admissionOnce, initAdmission);
+    pthread_mutex_lock(&admissionLock);
+    if (priority == ADMIT_CUSTOMER && admission.waiting[priority] >= ADMISSION_QUEUE) {
+        admission.shed[priority]++;
+        pthread_mutex_unlock(&admissionLock);
+        return 0;
+    }
+    if (++admission.waiting[priority] > admission.peakWaiting[priority]) {
+        admission.peakWaiting[priority] = admission.waiting[priority];
+    }
 
-    sqlite3_open(DB_NAME, &db);
-    char sql[100];
-    sprintf(sql, "SELECT * FROM ATM_Cards WHERE id = %d", cardId);
+    double deadline = monotonicSeconds() + ADMISSION_WAIT_MS / 1000.0;
+    double needed = priority == ADMIT_CRITICAL || admissionRate <= 0 ? 0 : priority == ADMIT_BATCH ? ADMISSION_BURST / 2.0 : 1;
+    while (1) {
+        double now = monotonicSeconds();
+        admissionTokens += (now - admissionRefilledAt) * admissionRate;
+        if (admissionTokens > ADMISSION_BURST) {
+            admissionTokens = ADMISSION_BURST;
+        }
+        admissionRefilledAt = now;
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            card->id = sqlite3_column_int(stmt, 0);
-            card->pin = sqlite3_column_int(stmt, 1);
-            card->balance = sqlite3_column_double(stmt, 2);
-            card->blocked = sqlite3_column_int(stmt, 3);
-            strcpy(card->ownerName, (const char *)sqlite3_column_text(stmt, 4));
-            found = 1;
+        int ahead = 0;
+        for (int p = 0; p < priority; p++) {
+            ahead += admission.waiting[p];
+        }
+        if (!admissionBusy && ahead == 0 && admissionTokens >= needed) {
+            break;
+        }
+        if (priority == ADMIT_CUSTOMER && now >= deadline) {
+            admission.waiting[priority]--;
+            admission.shed[priority]++;
+            pthread_mutex_unlock(&admissionLock);
+            return 0;
         }
+
+        // Woken by admissionLeave when the writer frees up, or by the timeout once
+        // enough tokens should have accrued.
+        double wake = admissionRate > 0 && admissionTokens < needed ? now + (needed - admissionTokens) / admissionRate : now + 0.01;
+        if (priority == ADMIT_CUSTOMER && wake > deadline) {
+            wake = deadline;
+        }
+        struct timespec until = {(time_t)wake, (long)((wake - (time_t)wake) * 1e9)};
+        pthread_cond_timedwait(&admissionReady, &admissionLock, &until);
     }
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    return found;
+    admission.waiting[priority]--;
+    admission.admitted[priority]++;
+    if (priority != ADMIT_CRITICAL && admissionRate > 0) {
+        admissionTokens -= 1;
+    }
+    admissionBusy = 1;
+    pthread_mutex_unlock(&admissionLock);
+    return 1;
 }
 
-void updateBalance(int cardId, double newBalance) {
-    sqlite3 *db;
-    char sql[100];
+void admissionLeave() {
+    pthread_mutex_lock(&admissionLock);
+    admissionBusy = 0;
+    pthread_cond_broadcast(&admissionReady);
+    pthread_mutex_unlock(&admissionLock);
+}
 
-    sqlite3_open(DB_NAME, &db);
-    sprintf(sql, "UPDATE ATM_Cards SET balance = %.2f WHERE id = %d", newBalance, cardId);
-    sqlite3_exec(db, sql, 0, 0, 0);
-    sqlite3_close(db);
+void admissionSnapshot(AdmissionStats *stats) {
+    pthread_mutex_lock(&admissionLock);
+    *stats = admission;
+    pthread_mutex_unlock(&admissionLock);
 }
 
-void updatePin(int cardId, int newPin) {
-    if (!isValidPin(newPin)) {
-        printf("Error: PIN must be a 4-digit number.\n");
+void printAdmissionStats() {
+    static const char *names[ADMIT_PRIORITIES] = {"critical", "customer", "batch"};
+    AdmissionStats stats;
+
+    admissionSnapshot(&stats);
+    for (int p = 0; p < ADMIT_PRIORITIES; p++) {
+        printf("Admission %-8s admitted %ld, shed %ld, queued %d (peak %d)\n", names[p],
+               stats.admitted[p], stats.shed[p], stats.waiting[p], stats.peakWaiting[p]);
+    }
+}
+
+// Returns NULL if the database cannot be opened or the request was shed.
+sqlite3 *dbWriterAcquirePriority(int priority) {
+    if (!admissionEnter(priority)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&writerLock);
+    if (writerDb == NULL) {
+        int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI;
+        if (sqlite3_open_v2(dbPath, &writerDb, flags, 0) != SQLITE_OK) {
+            printf("Error opening database.\n");
+            sqlite3_close(writerDb);
+            writerDb = NULL;
+            pthread_mutex_unlock(&writerLock);
+            admissionLeave();
+            return NULL;
+        }
+        sqlite3_busy_timeout(writerDb, 5000);
+        sqlite3_exec(writerDb, "PRAGMA journal_mode = WAL", 0, 0, 0);
+        // Ledger commits must survive power loss, whatever default the library was built with.
+        sqlite3_exec(writerDb, "PRAGMA synchronous = FULL", 0, 0, 0);
+        cdcAttach(writerDb);
+    }
+    return writerDb;
+}
+
+sqlite3 *dbWriterAcquire() {
+    return dbWriterAcquirePriority(writerPriority);
+}
+
+void dbWriterRelease() {
+    pthread_mutex_unlock(&writerLock);
+    admissionLeave();
+}
+
+// Selects the database before any connection is opened. ":memory:" maps to one
+// in-memory database shared by every connection in this process (the memdb VFS
+// shares databases whose name starts with '/'); it lives until the pool is closed.
+void setDatabasePath(const char *path) {
+    dbPath = strcmp(path, ":memory:") == 0 ? MEMORY_DB_URI : path;
+}
+
+void closeDatabasePool() {
+    pthread_mutex_lock(&writerLock);
+    sqlite3_close(writerDb);
+    writerDb = NULL;
+    pthread_mutex_unlock(&writerLock);
+
+    pthread_once(&readerKeyOnce, createReaderKey);
+    sqlite3_close(pthread_getspecific(readerKey));
+    pthread_setspecific(readerKey, NULL);
+}
+
+// Change-data capture. Hooks on the writer connection collect field-level changes
+// to ATM_Cards while a transaction runs and publish them only once it commits:
+// from the WAL hook, which SQLite calls after the commit is in the log, or from
+// the commit hook when the database is not in WAL mode. A rollback drops them.
+// Every event of a commit carries the same sequence number, the last ATM_ChangeLog
+// seq written by that commit, so consumers can order commits and resynchronise
+// from ATM_ChangeLog after a gap. A commit is written to each subscriber (clients
+// of ATM_CDC_SOCKET, and the ATM_CDC_FILE file) in a single write; a subscriber
+// that cannot keep up is disconnected rather than allowed to stall the writer.
+typedef struct {
+    int cardId;
+    const char *field;
+    char oldValue[CDC_VALUE_SIZE];
+    char newValue[CDC_VALUE_SIZE];
+} CdcEvent;
+
+static pthread_mutex_t cdcLock = PTHREAD_MUTEX_INITIALIZER;
+static int cdcEnabled = 0;
+static int cdcWal = 0;
+static int cdcFile = -1;
+static int cdcListener = -1;
+static int cdcSubscribers[CDC_MAX_SUBSCRIBERS];
+static int cdcSubscriberCount = 0;
+static CdcEvent *cdcPending = NULL;
+static size_t cdcPendingCount = 0;
+static size_t cdcPendingCapacity = 0;
+static long long cdcPendingSeq = 0;
+static char *cdcBuffer = NULL;
+static size_t cdcBufferSize = 0;
+
+static void cdcFormatValue(char *out, sqlite3_value *value) {
+    if (value == NULL || sqlite3_value_type(value) == SQLITE_NULL) {
+        snprintf(out, CDC_VALUE_SIZE, "null");
+    } else if (sqlite3_value_type(value) == SQLITE_TEXT) {
+        const unsigned char *text = sqlite3_value_text(value);
+        size_t used = 0;
+        out[used++] = '"';
+        for (; *text != '\0' && used < CDC_VALUE_SIZE - 8; text++) {
+            if (*text == '"' || *text == '\\') {
+                out[used++] = '\\';
+                out[used++] = (char)*text;
+            } else if (*text < 0x20) {
+                used += (size_t)snprintf(out + used, CDC_VALUE_SIZE - used, "\\u%04x", *text);
+            } else {
+                out[used++] = (char)*text;
+            }
+        }
+        out[used++] = '"';
+        out[used] = '\0';
+    } else if (sqlite3_value_type(value) == SQLITE_FLOAT) {
+        snprintf(out, CDC_VALUE_SIZE, "%.15g", sqlite3_value_double(value));
+    } else {
+        snprintf(out, CDC_VALUE_SIZE, "%lld", (long long)sqlite3_value_int64(value));
+    }
+}
+
+// Compares without sqlite3_value_text, which would attach a text form to numeric
+// values and change the type they report afterwards.
+static int cdcSameValue(sqlite3_value *a, sqlite3_value *b) {
+    int type = sqlite3_value_type(a);
+    int otherType = sqlite3_value_type(b);
+
+    if ((type == SQLITE_INTEGER || type == SQLITE_FLOAT) && (otherType == SQLITE_INTEGER || otherType == SQLITE_FLOAT)) {
+        return sqlite3_value_double(a) == sqlite3_value_double(b);
+    }
+    if (type != otherType) {
+        return 0;
+    }
+    if (type == SQLITE_TEXT) {
+        return strcmp((const char *)sqlite3_value_text(a), (const char *)sqlite3_value_text(b)) == 0;
+    }
+    return type == SQLITE_NULL;
+}
+
+static void cdcAddEvent(int cardId, const char *field, sqlite3_value *oldValue, sqlite3_value *newValue) {
+    if (cdcPendingCount == cdcPendingCapacity) {
+        size_t capacity = cdcPendingCapacity ? cdcPendingCapacity * 2 : 64;
+        CdcEvent *events = realloc(cdcPending, capacity * sizeof(CdcEvent));
+        if (events == NULL) {
+            return;
+        }
+        cdcPending = events;
+        cdcPendingCapacity = capacity;
+    }
+    CdcEvent *event = &cdcPending[cdcPendingCount++];
+    event->cardId = cardId;
+    event->field = field;
+    cdcFormatValue(event->oldValue, oldValue);
+    cdcFormatValue(event->newValue, newValue);
+}
+
+// Column order of ATM_Cards: id, pinHash, balance, blocked, ownerName, failedAttempts. PIN hashes are
+// never published; a PIN change is reported as a "pin" event without them.
+static void cdcPreupdate(void *arg, sqlite3 *db, int op, const char *database, const char *table,
+                         sqlite3_int64 oldKey, sqlite3_int64 newKey) {
+    static const char *fields[] = {"id", "pin", "balance", "blocked", "ownerName", "failedAttempts"};
+    (void)arg;
+    (void)database;
+
+    if (strcmp(table, "ATM_ChangeLog") == 0 && op == SQLITE_INSERT) {
+        if (newKey > cdcPendingSeq) {
+            cdcPendingSeq = newKey;
+        }
         return;
     }
+    if (strcmp(table, "ATM_Cards") != 0) {
+        return;
+    }
+    if (op == SQLITE_DELETE) {
+        cdcAddEvent((int)oldKey, "deleted", NULL, NULL);
+        return;
+    }
+    for (int column = 1; column < 6; column++) {
+        sqlite3_value *oldValue = NULL, *newValue = NULL;
+        sqlite3_preupdate_new(db, column, &newValue);
+        if (op == SQLITE_UPDATE) {
+            sqlite3_preupdate_old(db, column, &oldValue);
+            if (cdcSameValue(oldValue, newValue)) {
+                continue;
+            }
+        }
+        if (column == 1) {
+            cdcAddEvent((int)newKey, fields[column], NULL, NULL);
+        } else {
+            cdcAddEvent((int)newKey, fields[column], oldValue, newValue);
+        }
+    }
+}
 
-    if (isWeakPin(newPin)) {
-        printf("Error: PIN is too weak. Choose a stronger PIN.\n");
+static void cdcPublish() {
+    size_t used = 0;
+
+    if (cdcPendingCount == 0) {
         return;
     }
+    for (size_t i = 0; i < cdcPendingCount; i++) {
+        size_t needed = used + 96 + 2 * CDC_VALUE_SIZE;
+        if (needed > cdcBufferSize) {
+            char *buffer = realloc(cdcBuffer, needed * 2);
+            if (buffer == NULL) {
+                break;
+            }
+            cdcBuffer = buffer;
+            cdcBufferSize = needed * 2;
+        }
+        CdcEvent *event = &cdcPending[i];
+        used += (size_t)snprintf(cdcBuffer + used, cdcBufferSize - used,
+                                 "{\"seq\":%lld,\"card\":%d,\"field\":\"%s\",\"old\":%s,\"new\":%s}\n",
+                                 cdcPendingSeq, event->cardId, event->field, event->oldValue, event->newValue);
+    }
 
-    sqlite3 *db;
-    char sql[100];
+    pthread_mutex_lock(&cdcLock);
+    if (cdcFile >= 0 && write(cdcFile, cdcBuffer, used) != (ssize_t)used) {
+        printf("CDC file write failed; events for commit %lld are incomplete.\n", cdcPendingSeq);
+    }
+    for (int i = 0; i < cdcSubscriberCount;) {
+        if (send(cdcSubscribers[i], cdcBuffer, used, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)used) {
+            close(cdcSubscribers[i]);
+            cdcSubscribers[i] = cdcSubscribers[--cdcSubscriberCount];
+            continue;
+        }
+        i++;
+    }
+    pthread_mutex_unlock(&cdcLock);
+}
 
-    sqlite3_open(DB_NAME, &db);
-    sprintf(sql, "UPDATE ATM_Cards SET pin = %d WHERE id = %d", newPin, cardId);
-    sqlite3_exec(db, sql, 0, 0, 0);
-    sqlite3_close(db);
-    printf("PIN changed successfully.\n");
+static int cdcCommit(void *arg) {
+    (void)arg;
+    if (!cdcWal) {
+        cdcPublish();
+        cdcPendingCount = 0;
+    }
+    return 0;
 }
 
-void blockCard(int cardId) {
-    sqlite3 *db;
-    char sql[100];
+static void cdcRollback(void *arg) {
+    (void)arg;
+    cdcPendingCount = 0;
+}
 
-    sqlite3_open(DB_NAME, &db);
-    sprintf(sql, "UPDATE ATM_Cards SET blocked = 1 WHERE id = %d", cardId);
-    sqlite3_exec(db, sql, 0, 0, 0);
-    sqlite3_close(db);
+// Installing a WAL hook replaces SQLite's automatic checkpoint, so it is done here.
+static int cdcWalCommitted(void *arg, sqlite3 *db, const char *database, int pages) {
+    (void)arg;
+    cdcPublish();
+    cdcPendingCount = 0;
+    if (pages >= CDC_CHECKPOINT_PAGES) {
+        sqlite3_wal_checkpoint(db, database);
+    }
+    return SQLITE_OK;
 }
 
-void contactBank(int cardId) {
-    char name[50];
-    printf("Enter your full name to unblock the card: ");
-    scanf(" %[^\n]s", name);
+static void *cdcAcceptSubscribers(void *arg) {
+    (void)arg;
+    while (1) {
+        int fd = accept(cdcListener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        pthread_mutex_lock(&cdcLock);
+        if (cdcSubscriberCount < CDC_MAX_SUBSCRIBERS) {
+            cdcSubscribers[cdcSubscriberCount++] = fd;
+        } else {
+            close(fd);
+        }
+        pthread_mutex_unlock(&cdcLock);
+    }
+    return NULL;
+}
 
-    sqlite3 *db;
+void cdcAttach(sqlite3 *db) {
     sqlite3_stmt *stmt;
-    int found = 0;
 
-    sqlite3_open(DB_NAME, &db);
-    char sql[100];
-    sprintf(sql, "SELECT ownerName FROM ATM_Cards WHERE id = %d", cardId);
+    if (!cdcEnabled) {
+        return;
+    }
+    cdcWal = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA journal_mode", -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        cdcWal = strcmp((const char *)sqlite3_column_text(stmt, 0), "wal") == 0;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_preupdate_hook(db, cdcPreupdate, NULL);
+    sqlite3_commit_hook(db, cdcCommit, NULL);
+    sqlite3_rollback_hook(db, cdcRollback, NULL);
+    if (cdcWal) {
+        sqlite3_wal_hook(db, cdcWalCommitted, NULL);
+    }
+}
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *storedName = (const char *)sqlite3_column_text(stmt, 0);
-            if (strcmp(storedName, name) == 0) {
-                found = 1;
-            }
+int cdcOpen(const char *socketPath, const char *filePath) {
+    if (filePath != NULL && (cdcFile = open(filePath, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        printf("Error opening CDC file %s.\n", filePath);
+        return -1;
+    }
+    if (socketPath != NULL) {
+        struct sockaddr_un address;
+        pthread_t acceptor;
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+        unlink(socketPath);
+        if ((cdcListener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            bind(cdcListener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(cdcListener, 16) < 0) {
+            printf("Error listening for CDC subscribers on %s.\n", socketPath);
+            return -1;
         }
+        pthread_create(&acceptor, 0, cdcAcceptSubscribers, NULL);
+        pthread_detach(acceptor);
     }
-    sqlite3_finalize(stmt);
+    cdcEnabled = 1;
 
-    if (found) {
-        sprintf(sql, "UPDATE ATM_Cards SET blocked = 0 WHERE id = %d", cardId);
-        sqlite3_exec(db, sql, 0, 0, 0);
-        printf("Card unblocked successfully.\n");
-    } else {
-        printf("Incorrect name. Card remains blocked.\n");
+    // A writer connection opened before now gets its hooks here; later ones get
+    // them when dbWriterAcquirePriority opens them.
+    pthread_mutex_lock(&writerLock);
+    if (writerDb != NULL) {
+        cdcAttach(writerDb);
     }
-    sqlite3_close(db);
+    pthread_mutex_unlock(&writerLock);
+    return 0;
 }
 
-int withdrawMoney(Card *card, double amount) {
-    if ((int)amount % 5 != 0) {
-        printf("Error: Withdrawal amount must be divisible by 5, 10, or 20.\n");
-        return 0;
+// Subscriber used for debugging and by downstream scripts: prints the feed.
+int runCdcTail(const char *socketPath) {
+    struct sockaddr_un address;
+    char buffer[4096];
+    ssize_t length;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        printf("Error connecting to %s.\n", socketPath);
+        return 1;
+    }
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, (size_t)length, stdout);
+        fflush(stdout);
+    }
+    close(fd);
+    return 0;
+}
+
+// Audit log. Records go to preallocated, memory-mapped segment files in
+// ATM_AUDIT_DIR, so an append is a memcpy under auditLock plus an asynchronous
+// msync every AUDIT_SYNC_EVERY records, and never touches the SQLite writer. Each
+// record carries a CRC32; on startup the newest segment is scanned to find where
+// the last good record ends.
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t sequence;
+    int64_t timestamp;
+    int32_t cardId;
+    int32_t terminalId;
+    int32_t op;
+    int32_t result;
+    int64_t amountPence;
+    int64_t balancePence;
+} AuditRecord;
+
+typedef struct {
+    char dir[200];
+    int segment;
+    int fd;
+    uint8_t *map;
+    size_t offset;
+    uint64_t sequence;
+    size_t unsynced;
+} AuditLog;
+
+AuditLog auditLog = {"", 0, -1, NULL, 0, 0, 0};
+pthread_mutex_t auditLock = PTHREAD_MUTEX_INITIALIZER;
+const char *auditOpNames[] = {"?", "auth", "withdraw", "deposit", "pin-change", "block", "unblock", "transfer"};
+
+uint32_t crcTable[256];
+pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crcTable[i] = c;
     }
+}
 
-    if (amount > 0 && amount <= card->balance) {
-        double oldBalance = card->balance;
-        card->balance -= amount;
-        updateBalance(card->id, card->balance);
-        printf("Withdrawal successful. New balance: £%.2f\n", card->balance);
+uint32_t crc32(const void *data, size_t length) {
+    const uint8_t *p = data;
+    uint32_t crc = 0xFFFFFFFFu;
 
-        if (wantsReceipt()) {
-            printReceipt(card, "Withdrawal", amount, oldBalance);
+    pthread_once(&crcTableOnce, buildCrcTable);
+    for (size_t i = 0; i < length; i++) {
+        crc = crcTable[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static uint32_t auditChecksum(const AuditRecord *record) {
+    return crc32(&record->sequence, sizeof(AuditRecord) - offsetof(AuditRecord, sequence));
+}
+
+static void auditSegmentPath(char *path, size_t size, const char *dir, int segment) {
+    snprintf(path, size, "%s/audit-%06d.log", dir, segment);
+}
+
+static int auditMapSegment(AuditLog *log, int segment) {
+    char path[256];
+
+    auditSegmentPath(path, sizeof(path), log->dir, segment);
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    if (posix_fallocate(fd, 0, AUDIT_SEGMENT_SIZE) != 0) {
+        close(fd);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, AUDIT_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    log->segment = segment;
+    log->fd = fd;
+    log->map = map;
+    log->offset = 0;
+
+    // Resume after the last intact record; anything past it was torn by a crash.
+    while (log->offset + sizeof(AuditRecord) <= AUDIT_SEGMENT_SIZE) {
+        AuditRecord *record = (AuditRecord *)(map + log->offset);
+        if (record->magic != AUDIT_MAGIC || record->crc != auditChecksum(record)) {
+            break;
         }
-        return 1;
-    } else {
-        printf("Insufficient funds.\n");
+        log->sequence = record->sequence;
+        log->offset += sizeof(AuditRecord);
+    }
+    return 0;
+}
+
+static void auditUnmapSegment(AuditLog *log) {
+    if (log->map != NULL) {
+        msync(log->map, AUDIT_SEGMENT_SIZE, MS_SYNC);
+        munmap(log->map, AUDIT_SEGMENT_SIZE);
+        close(log->fd);
+        log->map = NULL;
+        log->fd = -1;
+    }
+}
+
+int auditOpen(const char *dir) {
+    char path[256];
+    int segment = 1;
+
+    mkdir(dir, 0700);
+    pthread_mutex_lock(&auditLock);
+    snprintf(auditLog.dir, sizeof(auditLog.dir), "%s", dir);
+    for (;; segment++) {
+        auditSegmentPath(path, sizeof(path), dir, segment + 1);
+        if (access(path, F_OK) != 0) {
+            break;
+        }
+    }
+    int result = auditMapSegment(&auditLog, segment);
+    pthread_mutex_unlock(&auditLock);
+    if (result != 0) {
+        printf("Error opening audit log in %s.\n", dir);
+    }
+    return result;
+}
+
+void auditClose() {
+    pthread_mutex_lock(&auditLock);
+    auditUnmapSegment(&auditLog);
+    pthread_mutex_unlock(&auditLock);
+}
+
+void auditEvent(int cardId, int op, double amount, double balance, int result) {
+    AuditRecord record;
+
+    if (auditLog.map == NULL) {
+        return;
+    }
+    memset(&record, 0, sizeof(record));
+    record.magic = AUDIT_MAGIC;
+    record.timestamp = (int64_t)time(NULL);
+    record.cardId = cardId;
+    record.terminalId = currentTerminal();
+    record.op = op;
+    record.result = result;
+    record.amountPence = llround(amount * 100);
+    record.balancePence = llround(balance * 100);
+
+    pthread_mutex_lock(&auditLock);
+    if (auditLog.map == NULL) {
+        pthread_mutex_unlock(&auditLock);
+        return;
+    }
+    if (auditLog.offset + sizeof(AuditRecord) > AUDIT_SEGMENT_SIZE) {
+        auditUnmapSegment(&auditLog);
+        if (auditMapSegment(&auditLog, auditLog.segment + 1) != 0) {
+            pthread_mutex_unlock(&auditLock);
+            return;
+        }
+    }
+    record.sequence = ++auditLog.sequence;
+    record.crc = auditChecksum(&record);
+    memcpy(auditLog.map + auditLog.offset, &record, sizeof(record));
+    auditLog.offset += sizeof(record);
+
+    if (++auditLog.unsynced >= AUDIT_SYNC_EVERY) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = (auditLog.offset - auditLog.unsynced * sizeof(record)) / page * page;
+        msync(auditLog.map + start, auditLog.offset - start, MS_ASYNC);
+        auditLog.unsynced = 0;
+    }
+    pthread_mutex_unlock(&auditLock);
+}
+
+int dumpAuditLog(const char *dir) {
+    char path[256];
+    long records = 0, corrupt = 0;
+
+    for (int segment = 1;; segment++) {
+        auditSegmentPath(path, sizeof(path), dir, segment);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            break;
+        }
+        struct stat info;
+        fstat(fd, &info);
+        uint8_t *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            printf("Error reading %s.\n", path);
+            return 1;
+        }
+
+        for (size_t offset = 0; offset + sizeof(AuditRecord) <= (size_t)info.st_size; offset += sizeof(AuditRecord)) {
+            const AuditRecord *record = (const AuditRecord *)(map + offset);
+            if (record->magic != AUDIT_MAGIC) {
+                break;
+            }
+            if (record->crc != auditChecksum(record)) {
+                printf("%s+%zu: checksum mismatch\n", path, offset);
+                corrupt++;
+                continue;
+            }
+            char date[20];
+            time_t when = (time_t)record->timestamp;
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&when));
+            int op = record->op > 0 && record->op <= AUDIT_TRANSFER ? record->op : 0;
+            printf("%llu %s card=%d terminal=%d op=%s amount=£%.2f balance=£%.2f result=%d\n",
+                   (unsigned long long)record->sequence, date, record->cardId, record->terminalId,
+                   auditOpNames[op], record->amountPence / 100.0, record->balancePence / 100.0, record->result);
+            records++;
+        }
+        munmap(map, (size_t)info.st_size);
+    }
+    printf("%ld records, %ld corrupt\n", records, corrupt);
+    return corrupt == 0 ? 0 : 1;
+}
+
+// Creates a derived structure (index, aggregate table) together with its triggers and
+// its initial contents in one transaction, the first time the database is opened by a
+// build that knows about it.
+static void createDerived(sqlite3 *db, const char *name, const char *sql) {
+    sqlite3_stmt *stmt;
+    int exists = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        exists = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    if (exists) {
+        return;
+    }
+    sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+    if (sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK) {
+        printf("SQL Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        return;
+    }
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+}
+
+// Every table holding state a promoted standby needs. Derived tables (stats, owner
+// index) are rebuilt on the standby by its own triggers, and ATM_Meta and the logs
+// are per-database.
+static const char *replicatedTables[] = {
+    "ATM_Cards", "ATM_Transactions", "ATM_Requests", "ATM_Archives",
+    "ATM_BatchJobs", "ATM_BatchChunks", "ATM_StandingOrders", "ATM_OrderPayments",
+};
+#define REPLICATED_TABLES (int)(sizeof(replicatedTables) / sizeof(replicatedTables[0]))
+
+// Each replicated table gets triggers that log the primary key of every row they
+// touch (both keys when an update changes it) as a JSON array. Only keys are logged:
+// the standby reads the row itself, so nothing sensitive is copied into the log.
+static void createReplicaTriggers(sqlite3 *db) {
+    static const char *now = "CAST(strftime('%s', 'now') AS INTEGER)";
+
+    for (int i = 0; i < REPLICATED_TABLES; i++) {
+        const char *table = replicatedTables[i];
+        sqlite3_stmt *info;
+        sqlite3_str *newKey = sqlite3_str_new(db);
+        sqlite3_str *oldKey = sqlite3_str_new(db);
+
+        if (sqlite3_prepare_v2(db, "SELECT name FROM pragma_table_info(?, 'main') WHERE pk > 0 ORDER BY pk",
+                               -1, &info, 0) == SQLITE_OK) {
+            sqlite3_bind_text(info, 1, table, -1, SQLITE_STATIC);
+            for (int k = 0; sqlite3_step(info) == SQLITE_ROW; k++) {
+                const char *column = (const char *)sqlite3_column_text(info, 0);
+                sqlite3_str_appendf(newKey, "%sNEW.\"%w\"", k ? ", " : "", column);
+                sqlite3_str_appendf(oldKey, "%sOLD.\"%w\"", k ? ", " : "", column);
+            }
+        }
+        sqlite3_finalize(info);
+        char *newList = sqlite3_str_finish(newKey);
+        char *oldList = sqlite3_str_finish(oldKey);
+        char *sql = newList == NULL ? NULL : sqlite3_mprintf(
+            "CREATE TRIGGER IF NOT EXISTS \"trg_replica_%w_insert\" AFTER INSERT ON \"%w\" BEGIN "
+            "INSERT INTO ATM_ReplicaLog (tableName, rowKey, changedAt) VALUES (%Q, json_array(%s), %s); END;"
+            "CREATE TRIGGER IF NOT EXISTS \"trg_replica_%w_update\" AFTER UPDATE ON \"%w\" BEGIN "
+            "INSERT INTO ATM_ReplicaLog (tableName, rowKey, changedAt) VALUES (%Q, json_array(%s), %s); "
+            "INSERT INTO ATM_ReplicaLog (tableName, rowKey, changedAt) SELECT %Q, json_array(%s), %s "
+            "WHERE json_array(%s) IS NOT json_array(%s); END;"
+            "CREATE TRIGGER IF NOT EXISTS \"trg_replica_%w_delete\" AFTER DELETE ON \"%w\" BEGIN "
+            "INSERT INTO ATM_ReplicaLog (tableName, rowKey, changedAt) VALUES (%Q, json_array(%s), %s); END;",
+            table, table, table, newList, now,
+            table, table, table, newList, now, table, oldList, now, oldList, newList,
+            table, table, table, oldList, now);
+        if (sql == NULL || sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK) {
+            printf("SQL Error: %s\n", sqlite3_errmsg(db));
+        }
+        sqlite3_free(sql);
+        sqlite3_free(newList);
+        sqlite3_free(oldList);
+    }
+}
+
+// Highest transaction id in any month file, so a migrated ledger never hands out
+// an id that was archived after being the newest row.
+static long long archivedMaxId(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    long long maxId = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT path FROM ATM_Archives", -1, &stmt, 0) != SQLITE_OK) {
+        return 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        sqlite3 *archive;
+        sqlite3_stmt *query;
+        if (sqlite3_open_v2((const char *)sqlite3_column_text(stmt, 0), &archive, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK &&
+            sqlite3_prepare_v2(archive, "SELECT MAX(id) FROM ATM_Transactions", -1, &query, 0) == SQLITE_OK) {
+            if (sqlite3_step(query) == SQLITE_ROW && sqlite3_column_int64(query, 0) > maxId) {
+                maxId = sqlite3_column_int64(query, 0);
+            }
+            sqlite3_finalize(query);
+        }
+        sqlite3_close(archive);
+    }
+    sqlite3_finalize(stmt);
+    return maxId;
+}
+
+void createSchema(sqlite3 *db) {
+    const char *sql = "CREATE TABLE IF NOT EXISTS ATM_Cards ("
+                      "id INTEGER PRIMARY KEY, "
+                      "pinHash TEXT, "
+                      "balance REAL, "
+                      "blocked INTEGER, "
+                      "ownerName TEXT, "
+                      "failedAttempts INTEGER NOT NULL DEFAULT 0);"
+                      "CREATE TABLE IF NOT EXISTS ATM_Transactions ("
+                      "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                      "cardId INTEGER, "
+                      "terminalId INTEGER, "
+                      "type TEXT, "
+                      "amount REAL, "
+                      "oldBalance REAL, "
+                      "newBalance REAL, "
+                      "timestamp INTEGER);"
+                      "CREATE INDEX IF NOT EXISTS idx_transactions_card "
+                      "ON ATM_Transactions(cardId, id);"
+                      "CREATE INDEX IF NOT EXISTS idx_transactions_card_time "
+                      "ON ATM_Transactions(cardId, timestamp, id);"
+                      "CREATE INDEX IF NOT EXISTS idx_transactions_time "
+                      "ON ATM_Transactions(timestamp, id);"
+                      "CREATE TABLE IF NOT EXISTS ATM_Archives ("
+                      "month INTEGER PRIMARY KEY, "
+                      "path TEXT, "
+                      "rows INTEGER, "
+                      "firstTimestamp INTEGER, "
+                      "lastTimestamp INTEGER);"
+                      "CREATE TABLE IF NOT EXISTS ATM_Requests ("
+                      "cardId INTEGER, "
+                      "requestId INTEGER, "
+                      "type TEXT, "
+                      "amount REAL, "
+                      "result INTEGER, "
+                      "oldBalance REAL, "
+                      "newBalance REAL, "
+                      "timestamp INTEGER, "
+                      "PRIMARY KEY (cardId, requestId)) WITHOUT ROWID;"
+                      "CREATE INDEX IF NOT EXISTS idx_requests_time ON ATM_Requests(timestamp);"
+                      "CREATE TABLE IF NOT EXISTS ATM_ChangeLog ("
+                      "seq INTEGER PRIMARY KEY, "
+                      "cardId INTEGER, "
+                      "op TEXT, "
+                      "balance REAL, "
+                      "blocked INTEGER, "
+                      "ownerName TEXT, "
+                      "changedAt INTEGER);"
+                      "CREATE INDEX IF NOT EXISTS idx_changelog_time ON ATM_ChangeLog(changedAt);"
+                      "CREATE TRIGGER IF NOT EXISTS trg_cards_insert AFTER INSERT ON ATM_Cards BEGIN "
+                      "INSERT INTO ATM_ChangeLog (cardId, op, balance, blocked, ownerName, changedAt) "
+                      "VALUES (NEW.id, 'upsert', NEW.balance, NEW.blocked, NEW.ownerName, CAST(strftime('%s', 'now') AS INTEGER)); END;"
+                      "CREATE TRIGGER IF NOT EXISTS trg_cards_update AFTER UPDATE ON ATM_Cards BEGIN "
+                      "INSERT INTO ATM_ChangeLog (cardId, op, balance, blocked, ownerName, changedAt) "
+                      "VALUES (NEW.id, 'upsert', NEW.balance, NEW.blocked, NEW.ownerName, CAST(strftime('%s', 'now') AS INTEGER)); END;"
+                      "CREATE TRIGGER IF NOT EXISTS trg_cards_delete AFTER DELETE ON ATM_Cards BEGIN "
+                      "INSERT INTO ATM_ChangeLog (cardId, op, changedAt) VALUES (OLD.id, 'delete', CAST(strftime('%s', 'now') AS INTEGER)); END;"
+                      "CREATE TABLE IF NOT EXISTS ATM_ReplicaLog ("
+                      "seq INTEGER PRIMARY KEY AUTOINCREMENT, "
+                      "tableName TEXT, "
+                      "rowKey TEXT, "
+                      "changedAt INTEGER);"
+                      "CREATE INDEX IF NOT EXISTS idx_replicalog_time ON ATM_ReplicaLog(changedAt);"
+                      "CREATE TABLE IF NOT EXISTS ATM_Meta ("
+                      "key TEXT PRIMARY KEY, "
+                      "value INTEGER);"
+                      "CREATE TABLE IF NOT EXISTS ATM_BatchJobs ("
+                      "job TEXT PRIMARY KEY, "
+                      "rate REAL, "
+                      "startedAt INTEGER);"
+                      "CREATE TABLE IF NOT EXISTS ATM_BatchChunks ("
+                      "job TEXT, "
+                      "chunkStart INTEGER, "
+                      "accounts INTEGER, "
+                      "PRIMARY KEY (job, chunkStart));"
+                      "CREATE TABLE IF NOT EXISTS ATM_StandingOrders ("
+                      "id INTEGER PRIMARY KEY, "
+                      "fromCard INTEGER, "
+                      "toCard INTEGER, "
+                      "amount REAL, "
+                      "intervalSeconds INTEGER, "
+                      "nextRun INTEGER, "
+                      "active INTEGER);"
+                      "CREATE TABLE IF NOT EXISTS ATM_OrderPayments ("
+                      "orderId INTEGER, "
+                      "dueTime INTEGER, "
+                      "result INTEGER, "
+                      "paidAt INTEGER, "
+                      "PRIMARY KEY (orderId, dueTime)) WITHOUT ROWID;";
+
+    if (sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK) {
+        printf("SQL Error: %s\n", sqlite3_errmsg(db));
+    }
+
+    // Request ids were once unique on their own; older databases are rekeyed on
+    // (cardId, requestId) once, keeping the rows still inside the dedupe window.
+    sqlite3_stmt *layout;
+    int oldRequests = 0;
+    if (sqlite3_prepare_v2(db, "SELECT pk FROM pragma_table_info('ATM_Requests') WHERE name = 'cardId'", -1, &layout, 0) == SQLITE_OK &&
+        sqlite3_step(layout) == SQLITE_ROW) {
+        oldRequests = sqlite3_column_int(layout, 0) == 0;
+    }
+    sqlite3_finalize(layout);
+    if (oldRequests) {
+        sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+        if (sqlite3_exec(db, "ALTER TABLE ATM_Requests RENAME TO ATM_Requests_v1;"
+                             "CREATE TABLE ATM_Requests ("
+                             "cardId INTEGER, "
+                             "requestId INTEGER, "
+                             "type TEXT, "
+                             "amount REAL, "
+                             "result INTEGER, "
+                             "oldBalance REAL, "
+                             "newBalance REAL, "
+                             "timestamp INTEGER, "
+                             "PRIMARY KEY (cardId, requestId)) WITHOUT ROWID;"
+                             "INSERT OR IGNORE INTO ATM_Requests "
+                             "SELECT cardId, requestId, type, amount, result, oldBalance, newBalance, timestamp FROM ATM_Requests_v1;"
+                             "DROP TABLE ATM_Requests_v1;"
+                             "CREATE INDEX IF NOT EXISTS idx_requests_time ON ATM_Requests(timestamp);",
+                         0, 0, 0) != SQLITE_OK) {
+            printf("SQL Error: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        } else {
+            sqlite3_exec(db, "COMMIT", 0, 0, 0);
+        }
+    }
+
+    // Transaction ids were once plain rowids, which SQLite reuses once the newest row
+    // has been archived. Older ledgers are rebuilt with AUTOINCREMENT once, with the
+    // sequence starting past every id already in a month file. Dropping the old table
+    // drops its triggers too, so they are recreated from their saved SQL.
+    sqlite3_stmt *ledger;
+    int oldLedger = 0;
+    if (sqlite3_prepare_v2(db, "SELECT sql NOT LIKE '%AUTOINCREMENT%' FROM sqlite_master WHERE name = 'ATM_Transactions'",
+                           -1, &ledger, 0) == SQLITE_OK &&
+        sqlite3_step(ledger) == SQLITE_ROW) {
+        oldLedger = sqlite3_column_int(ledger, 0);
+    }
+    sqlite3_finalize(ledger);
+    if (oldLedger) {
+        long long archivedId = archivedMaxId(db);
+        char **triggers = NULL;
+        int triggerCount = 0, rc;
+
+        sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+        rc = sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE type = 'trigger' AND tbl_name = 'ATM_Transactions'",
+                                -1, &ledger, 0);
+        while (rc == SQLITE_OK && sqlite3_step(ledger) == SQLITE_ROW) {
+            char **grown = realloc(triggers, (size_t)(triggerCount + 1) * sizeof(*triggers));
+            if (grown == NULL || (grown[triggerCount] = strdup((const char *)sqlite3_column_text(ledger, 0))) == NULL) {
+                triggers = grown != NULL ? grown : triggers;
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            triggers = grown;
+            triggerCount++;
+        }
+        sqlite3_finalize(ledger);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, "CREATE TABLE ATM_Transactions_v2 ("
+                                  "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                  "cardId INTEGER, "
+                                  "terminalId INTEGER, "
+                                  "type TEXT, "
+                                  "amount REAL, "
+                                  "oldBalance REAL, "
+                                  "newBalance REAL, "
+                                  "timestamp INTEGER);"
+                                  "INSERT INTO ATM_Transactions_v2 "
+                                  "SELECT id, cardId, terminalId, type, amount, oldBalance, newBalance, timestamp FROM ATM_Transactions;"
+                                  "DROP TABLE ATM_Transactions;"
+                                  "ALTER TABLE ATM_Transactions_v2 RENAME TO ATM_Transactions;"
+                                  "CREATE INDEX idx_transactions_card ON ATM_Transactions(cardId, id);"
+                                  "CREATE INDEX idx_transactions_card_time ON ATM_Transactions(cardId, timestamp, id);"
+                                  "CREATE INDEX idx_transactions_time ON ATM_Transactions(timestamp, id);",
+                              0, 0, 0);
+        }
+        for (int i = 0; i < triggerCount; i++) {
+            if (rc == SQLITE_OK) {
+                rc = sqlite3_exec(db, triggers[i], 0, 0, 0);
+            }
+            free(triggers[i]);
+        }
+        free(triggers);
+        if (rc == SQLITE_OK) {
+            char *sequence = sqlite3_mprintf("INSERT INTO sqlite_sequence (name, seq) SELECT 'ATM_Transactions', 0 "
+                                             "WHERE NOT EXISTS (SELECT 1 FROM sqlite_sequence WHERE name = 'ATM_Transactions');"
+                                             "UPDATE sqlite_sequence SET seq = MAX(seq, %lld) WHERE name = 'ATM_Transactions';",
+                                             archivedId);
+            rc = sequence != NULL ? sqlite3_exec(db, sequence, 0, 0, 0) : SQLITE_NOMEM;
+            sqlite3_free(sequence);
+        }
+        if (rc != SQLITE_OK) {
+            printf("SQL Error: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        } else {
+            sqlite3_exec(db, "COMMIT", 0, 0, 0);
+        }
+    }
+
+    // Databases from before the failed-PIN counter get the column once.
+    sqlite3_stmt *probe;
+    if (sqlite3_prepare_v2(db, "SELECT failedAttempts FROM ATM_Cards LIMIT 0", -1, &probe, 0) != SQLITE_OK) {
+        sqlite3_exec(db, "ALTER TABLE ATM_Cards ADD COLUMN failedAttempts INTEGER NOT NULL DEFAULT 0", 0, 0, 0);
+    }
+    sqlite3_finalize(probe);
+
+    // PINs were once stored in "pin INTEGER", which by then held TEXT hashes, and the
+    // change log copied them. Older databases get ATM_Cards rebuilt once with
+    // "pinHash TEXT" and the hashes dropped from ATM_ChangeLog. The card's own
+    // triggers go with the old table: all but the change-log pair are recreated from
+    // their saved SQL, and that pair from the schema above without the PIN.
+    // A database from before the change log was created has it fresh from the
+    // schema above, without the column.
+    int oldPins = 0, loggedPins = 0;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('ATM_Cards') WHERE name = 'pin'", -1, &probe, 0) == SQLITE_OK) {
+        oldPins = sqlite3_step(probe) == SQLITE_ROW;
+    }
+    sqlite3_finalize(probe);
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('ATM_ChangeLog') WHERE name = 'pin'", -1, &probe, 0) == SQLITE_OK) {
+        loggedPins = sqlite3_step(probe) == SQLITE_ROW;
+    }
+    sqlite3_finalize(probe);
+    if (oldPins) {
+        char **triggers = NULL;
+        int triggerCount = 0, rc;
+
+        sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+        rc = sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE type = 'trigger' AND tbl_name = 'ATM_Cards' "
+                                    "AND name NOT IN ('trg_cards_insert', 'trg_cards_update')",
+                                -1, &probe, 0);
+        while (rc == SQLITE_OK && sqlite3_step(probe) == SQLITE_ROW) {
+            char **grown = realloc(triggers, (size_t)(triggerCount + 1) * sizeof(*triggers));
+            if (grown == NULL || (grown[triggerCount] = strdup((const char *)sqlite3_column_text(probe, 0))) == NULL) {
+                triggers = grown != NULL ? grown : triggers;
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            triggers = grown;
+            triggerCount++;
+        }
+        sqlite3_finalize(probe);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, "CREATE TABLE ATM_Cards_v2 ("
+                                  "id INTEGER PRIMARY KEY, "
+                                  "pinHash TEXT, "
+                                  "balance REAL, "
+                                  "blocked INTEGER, "
+                                  "ownerName TEXT, "
+                                  "failedAttempts INTEGER NOT NULL DEFAULT 0);"
+                                  "INSERT INTO ATM_Cards_v2 "
+                                  "SELECT id, CAST(pin AS TEXT), balance, blocked, ownerName, failedAttempts FROM ATM_Cards;"
+                                  "DROP TABLE ATM_Cards;"
+                                  "ALTER TABLE ATM_Cards_v2 RENAME TO ATM_Cards;",
+                              0, 0, 0);
+        }
+        if (rc == SQLITE_OK && loggedPins) {
+            rc = sqlite3_exec(db, "ALTER TABLE ATM_ChangeLog DROP COLUMN pin", 0, 0, 0);
+        }
+        for (int i = 0; i < triggerCount; i++) {
+            if (rc == SQLITE_OK) {
+                rc = sqlite3_exec(db, triggers[i], 0, 0, 0);
+            }
+            free(triggers[i]);
+        }
+        free(triggers);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(db, sql, 0, 0, 0);
+        }
+        if (rc != SQLITE_OK) {
+            printf("SQL Error: %s\n", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        } else {
+            sqlite3_exec(db, "COMMIT", 0, 0, 0);
+        }
+    }
+
+    createReplicaTriggers(db);
+
+    // The owner index is external-content: the triggers keep it in step with
+    // ATM_Cards, and a database created before the index existed is indexed once here.
+    createDerived(db, "ATM_OwnerIndex",
+                  "CREATE VIRTUAL TABLE ATM_OwnerIndex USING fts5("
+                  "ownerName, content='ATM_Cards', content_rowid='id', "
+                  "tokenize='unicode61 remove_diacritics 2', prefix='1 2 3');"
+                  "CREATE TRIGGER IF NOT EXISTS trg_owner_insert AFTER INSERT ON ATM_Cards BEGIN "
+                  "INSERT INTO ATM_OwnerIndex (rowid, ownerName) VALUES (NEW.id, NEW.ownerName); END;"
+                  "CREATE TRIGGER IF NOT EXISTS trg_owner_delete AFTER DELETE ON ATM_Cards BEGIN "
+                  "INSERT INTO ATM_OwnerIndex (ATM_OwnerIndex, rowid, ownerName) VALUES ('delete', OLD.id, OLD.ownerName); END;"
+                  "CREATE TRIGGER IF NOT EXISTS trg_owner_update AFTER UPDATE OF id, ownerName ON ATM_Cards BEGIN "
+                  "INSERT INTO ATM_OwnerIndex (ATM_OwnerIndex, rowid, ownerName) VALUES ('delete', OLD.id, OLD.ownerName); "
+                  "INSERT INTO ATM_OwnerIndex (rowid, ownerName) VALUES (NEW.id, NEW.ownerName); END;"
+                  "INSERT INTO ATM_OwnerIndex (ATM_OwnerIndex) VALUES ('rebuild');");
+
+    // Trigram index over the same names, used only to find candidates for fuzzy
+    // search. It replaces the ATM_OwnerTerms vocabulary table older builds scanned.
+    createDerived(db, "ATM_OwnerGrams",
+                  "DROP TABLE IF EXISTS ATM_OwnerTerms;"
+                  "CREATE VIRTUAL TABLE ATM_OwnerGrams USING fts5("
+                  "ownerName, content='ATM_Cards', content_rowid='id', tokenize='trigram');"
+                  "CREATE TRIGGER IF NOT EXISTS trg_owner_grams_insert AFTER INSERT ON ATM_Cards BEGIN "
+                  "INSERT INTO ATM_OwnerGrams (rowid, ownerName) VALUES (NEW.id, NEW.ownerName); END;"
+                  "CREATE TRIGGER IF NOT EXISTS trg_owner_grams_delete AFTER DELETE ON ATM_Cards BEGIN "
+                  "INSERT INTO ATM_OwnerGrams (ATM_OwnerGrams, rowid, ownerName) VALUES ('delete', OLD.id, OLD.ownerName); END;"
+                  "CREATE TRIGGER IF NOT EXISTS trg_owner_grams_update AFTER UPDATE OF id, ownerName ON ATM_Cards BEGIN "
+                  "INSERT INTO ATM_OwnerGrams (ATM_OwnerGrams, rowid, ownerName) VALUES ('delete', OLD.id, OLD.ownerName); "
+                  "INSERT INTO ATM_OwnerGrams (rowid, ownerName) VALUES (NEW.id, NEW.ownerName); END;"
+                  "INSERT INTO ATM_OwnerGrams (ATM_OwnerGrams) VALUES ('rebuild');");
+
+    // Dashboard aggregates, kept current by triggers inside the transaction that
+    // changes the card or ledger, so reading them never scans. Existing data is
+    // counted once when the tables are first created.
+    createDerived(db, "ATM_Stats",
+                  "CREATE TABLE ATM_Stats ("
+                  "id INTEGER PRIMARY KEY CHECK (id = 1), "
+                  "cards INTEGER, "
+                  "blockedCards INTEGER, "
+                  "totalBalance REAL, "
+                  "deposits REAL, "
+                  "withdrawals REAL);"
+                  "INSERT INTO ATM_Stats "
+                  "SELECT 1, COUNT(*), IFNULL(SUM(blocked != 0), 0), IFNULL(SUM(balance), 0), "
+                  "(SELECT IFNULL(SUM(amount), 0) FROM ATM_Transactions WHERE type = 'Deposit'), "
+                  "(SELECT IFNULL(-SUM(amount), 0) FROM ATM_Transactions WHERE type = 'Withdrawal') "
+                  "FROM ATM_Cards;"
+                  "CREATE TABLE ATM_TerminalDaily ("
+                  "terminalId INTEGER, "
+                  "day INTEGER, "
+                  "transactions INTEGER, "
+                  "credited REAL, "
+                  "debited REAL, "
+                  "PRIMARY KEY (terminalId, day)) WITHOUT ROWID;"
+                  "INSERT INTO ATM_TerminalDaily "
+                  "SELECT terminalId, timestamp / 86400, COUNT(*), SUM(MAX(amount, 0)), SUM(MAX(-amount, 0)) "
+                  "FROM ATM_Transactions "
+                  "GROUP BY terminalId, timestamp / 86400;"
+                  "CREATE INDEX IF NOT EXISTS idx_cards_balance ON ATM_Cards(balance);"
+                  "CREATE TRIGGER IF NOT EXISTS trg_stats_insert AFTER INSERT ON ATM_Cards BEGIN "
+                  "UPDATE ATM_Stats SET cards = cards + 1, blockedCards = blockedCards + (NEW.blocked != 0), "
+                  "totalBalance = totalBalance + NEW.balance WHERE id = 1; END;"
+                  "CREATE TRIGGER IF NOT EXISTS trg_stats_update AFTER UPDATE OF balance, blocked ON ATM_Cards BEGIN "
+                  "UPDATE ATM_Stats SET blockedCards = blockedCards + (NEW.blocked != 0) - (OLD.blocked != 0), "
+                  "totalBalance = totalBalance + NEW.balance - OLD.balance WHERE id = 1; END;"
+                  "CREATE TRIGGER IF NOT EXISTS trg_stats_delete AFTER DELETE ON ATM_Cards BEGIN "
+                  "UPDATE ATM_Stats SET cards = cards - 1, blockedCards = blockedCards - (OLD.blocked != 0), "
+                  "totalBalance = totalBalance - OLD.balance WHERE id = 1; END;"
+                  "CREATE TRIGGER IF NOT EXISTS trg_stats_ledger AFTER INSERT ON ATM_Transactions BEGIN "
+                  "UPDATE ATM_Stats SET deposits = deposits + IIF(NEW.type = 'Deposit', NEW.amount, 0), "
+                  "withdrawals = withdrawals - IIF(NEW.type = 'Withdrawal', NEW.amount, 0) "
+                  "WHERE id = 1 AND NEW.type IN ('Deposit', 'Withdrawal'); "
+                  "INSERT INTO ATM_TerminalDaily VALUES (NEW.terminalId, NEW.timestamp / 86400, 1, "
+                  "MAX(NEW.amount, 0), MAX(-NEW.amount, 0)) "
+                  "ON CONFLICT DO UPDATE SET transactions = transactions + 1, "
+                  "credited = credited + excluded.credited, debited = debited + excluded.debited; END;");
+}
+
+void initializeDatabase() {
+    sqlite3 *db = dbWriterAcquire();
+
+    if (db == NULL) {
+        return;
+    }
+    createSchema(db);
+    dbWriterRelease();
+}
+
+// PIN hashing. PINs are stored as "$pbkdf2-sha256$<iterations>$<salt>$<key>" (hex)
+// with a random 16-byte salt per card, computed with the in-tree SHA-256 below so
+// no crypto library is needed. A four-digit PIN has only 10,000 values, so the
+// point of the slow hash is to make every guess against a copied database cost
+// PIN_HASH_ITERATIONS rounds; the count is stored per row and can be raised later.
+// Rows from before hashing hold the plain integer until migratePins (or the next
+// successful login) rewrites them.
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t used;
+} Sha256;
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256Compress(uint32_t state[8], const uint8_t block[64]) {
+    uint32_t w[64];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void sha256Init(Sha256 *ctx) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256Update(Sha256 *ctx, const void *data, size_t length) {
+    const uint8_t *p = data;
+
+    ctx->length += length;
+    while (length > 0) {
+        size_t take = 64 - ctx->used < length ? 64 - ctx->used : length;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        length -= take;
+        if (ctx->used == 64) {
+            sha256Compress(ctx->state, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256Final(Sha256 *ctx, uint8_t digest[32]) {
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256Compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    sha256Compress(ctx->state, ctx->block);
+    for (int i = 0; i < 32; i++) {
+        digest[i] = (uint8_t)(ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+// PBKDF2-HMAC-SHA256 for a single 32-byte block. The keyed inner and outer states
+// are computed once, so each iteration costs two compressions.
+void pbkdf2Sha256(const void *password, size_t passwordLength, const uint8_t *salt, size_t saltLength,
+                  int iterations, uint8_t key[32]) {
+    uint8_t pad[64], u[32];
+    static const uint8_t blockIndex[4] = {0, 0, 0, 1};
+    Sha256 inner, outer, ctx;
+
+    memset(pad, 0, sizeof(pad));
+    if (passwordLength > 64) {
+        sha256Init(&ctx);
+        sha256Update(&ctx, password, passwordLength);
+        sha256Final(&ctx, pad);
+    } else {
+        memcpy(pad, password, passwordLength);
+    }
+    for (int i = 0; i < 64; i++) {
+        pad[i] ^= 0x36;
+    }
+    sha256Init(&inner);
+    sha256Update(&inner, pad, 64);
+    for (int i = 0; i < 64; i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    sha256Init(&outer);
+    sha256Update(&outer, pad, 64);
+
+    ctx = inner;
+    sha256Update(&ctx, salt, saltLength);
+    sha256Update(&ctx, blockIndex, sizeof(blockIndex));
+    sha256Final(&ctx, u);
+    ctx = outer;
+    sha256Update(&ctx, u, sizeof(u));
+    sha256Final(&ctx, u);
+    memcpy(key, u, sizeof(u));
+    for (int i = 1; i < iterations; i++) {
+        ctx = inner;
+        sha256Update(&ctx, u, sizeof(u));
+        sha256Final(&ctx, u);
+        ctx = outer;
+        sha256Update(&ctx, u, sizeof(u));
+        sha256Final(&ctx, u);
+        for (int j = 0; j < 32; j++) {
+            key[j] ^= u[j];
+        }
+    }
+}
+
+static void hexEncode(const uint8_t *data, size_t length, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 15];
+    }
+    out[2 * length] = '\0';
+}
+
+static int hexDecode(const char *text, uint8_t *out, size_t length) {
+    for (size_t i = 0; i < 2 * length; i++) {
+        char c = text[i];
+        int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (value < 0) {
+            return 0;
+        }
+        out[i / 2] = (uint8_t)(i % 2 == 0 ? value << 4 : out[i / 2] | value);
+    }
+    return text[2 * length] == '\0' || text[2 * length] == '$';
+}
+
+static void pinKey(int pin, const uint8_t *salt, int iterations, uint8_t key[32]) {
+    char text[8];
+    int length = snprintf(text, sizeof(text), "%04d", pin);
+    pbkdf2Sha256(text, (size_t)length, salt, PIN_SALT_SIZE, iterations, key);
+}
+
+// iterations is PIN_HASH_ITERATIONS for real cards; only the benchmark's synthetic
+// cards use fewer.
+int hashPin(int pin, int iterations, char *pinHash) {
+    uint8_t salt[PIN_SALT_SIZE], key[32];
+    char saltHex[2 * PIN_SALT_SIZE + 1], keyHex[65];
+
+    if (getrandom(salt, sizeof(salt), 0) != (ssize_t)sizeof(salt)) {
+        return 0;
+    }
+    pinKey(pin, salt, iterations, key);
+    hexEncode(salt, sizeof(salt), saltHex);
+    hexEncode(key, sizeof(key), keyHex);
+    snprintf(pinHash, PIN_HASH_SIZE, "$pbkdf2-sha256$%d$%s$%s", iterations, saltHex, keyHex);
+    return 1;
+}
+
+int isLegacyPin(const char *pinHash) {
+    return pinHash[0] != '$';
+}
+
+// Splits a stored hash into its iteration count, salt and key.
+static int parsePinHash(const char *pinHash, int *iterations, uint8_t salt[PIN_SALT_SIZE], uint8_t key[32]) {
+    int offset = 0;
+
+    return sscanf(pinHash, "$pbkdf2-sha256$%d$%n", iterations, &offset) == 1 && offset > 0 && *iterations >= 1 &&
+           hexDecode(pinHash + offset, salt, PIN_SALT_SIZE) &&
+           hexDecode(pinHash + offset + 2 * PIN_SALT_SIZE + 1, key, 32);
+}
+
+// Each terminal session remembers its own recent successful verifications for
+// PIN_CACHE_SECONDS, so repeated authorisation steps in that session do not pay for
+// the slow hash again, and nothing verified on one terminal speeds up guessing on
+// another. An entry holds a keyed SHA-256 of the stored hash and the PIN under a
+// per-process random key, never the PIN itself; a PIN change stores a new salt and
+// so misses. Failed attempts are never cached. A NULL cache disables caching.
+static uint8_t pinCacheKey[32];
+static int pinCacheKeyed = 0;
+static pthread_once_t pinCacheOnce = PTHREAD_ONCE_INIT;
+
+static void initPinCache() {
+    // Without a key every lookup simply misses.
+    pinCacheKeyed = getrandom(pinCacheKey, sizeof(pinCacheKey), 0) == (ssize_t)sizeof(pinCacheKey);
+}
+
+static void pinCacheDigest(int cardId, const char *pinHash, int pin, uint8_t digest[32]) {
+    Sha256 ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, pinCacheKey, sizeof(pinCacheKey));
+    sha256Update(&ctx, &cardId, sizeof(cardId));
+    sha256Update(&ctx, &pin, sizeof(pin));
+    sha256Update(&ctx, pinHash, strlen(pinHash));
+    sha256Final(&ctx, digest);
+}
+
+static int pinCacheLookup(PinCache *cache, int cardId, const char *pinHash, int pin) {
+    uint8_t digest[32];
+    time_t now = time(NULL);
+
+    pthread_once(&pinCacheOnce, initPinCache);
+    if (cache == NULL || !pinCacheKeyed) {
+        return 0;
+    }
+    pinCacheDigest(cardId, pinHash, pin, digest);
+    for (int i = 0; i < PIN_CACHE_SLOTS; i++) {
+        PinCacheEntry *entry = &cache->entries[i];
+        if (entry->cardId == cardId && entry->expires > now && memcmp(entry->digest, digest, sizeof(digest)) == 0) {
+            cache->hits++;
+            return 1;
+        }
+    }
+    cache->misses++;
+    return 0;
+}
+
+// Replaces the card's own entry, or else the one closest to expiry.
+static void pinCacheStore(PinCache *cache, int cardId, const char *pinHash, int pin) {
+    PinCacheEntry *entry;
+
+    pthread_once(&pinCacheOnce, initPinCache);
+    if (cache == NULL || !pinCacheKeyed) {
+        return;
+    }
+    entry = &cache->entries[0];
+    for (int i = 0; i < PIN_CACHE_SLOTS; i++) {
+        if (cache->entries[i].cardId == cardId) {
+            entry = &cache->entries[i];
+            break;
+        }
+        if (cache->entries[i].expires < entry->expires) {
+            entry = &cache->entries[i];
+        }
+    }
+    pinCacheDigest(cardId, pinHash, pin, entry->digest);
+    entry->cardId = cardId;
+    entry->expires = time(NULL) + PIN_CACHE_SECONDS;
+}
+
+int verifyPin(PinCache *cache, int cardId, const char *pinHash, int pin) {
+    uint8_t salt[PIN_SALT_SIZE], stored[32], key[32];
+    int iterations = 0;
+    uint8_t difference = 0;
+
+    if (isLegacyPin(pinHash)) {
+        char *end;
+        long legacy = strtol(pinHash, &end, 10);
+        return pinHash[0] != '\0' && *end == '\0' && legacy == pin;
+    }
+    if (!parsePinHash(pinHash, &iterations, salt, stored)) {
+        return 0;
+    }
+    if (pinCacheLookup(cache, cardId, pinHash, pin)) {
+        return 1;
+    }
+
+    pinKey(pin, salt, iterations, key);
+    for (int i = 0; i < 32; i++) {
+        difference |= key[i] ^ stored[i];
+    }
+    if (difference != 0) {
+        return 0;
+    }
+    pinCacheStore(cache, cardId, pinHash, pin);
+    return 1;
+}
+
+// Verifies a PIN for a loaded card and, if the row still holds a plain PIN,
+// replaces it with a hash now that the PIN is known to be right.
+int checkPin(PinCache *cache, Card *card, int pin) {
+    if (!verifyPin(cache, card->id, card->pinHash, pin)) {
+        return 0;
+    }
+    if (isLegacyPin(card->pinHash)) {
+        char pinHash[PIN_HASH_SIZE];
+        sqlite3 *db;
+        sqlite3_stmt *stmt;
+        if (hashPin(pin, PIN_HASH_ITERATIONS, pinHash) && (db = dbWriterAcquire()) != NULL) {
+            if (sqlite3_prepare_v2(db, "UPDATE ATM_Cards SET pinHash = ? WHERE id = ? AND pinHash = ?", -1, &stmt, 0) == SQLITE_OK) {
+                sqlite3_bind_text(stmt, 1, pinHash, -1, SQLITE_STATIC);
+                sqlite3_bind_int(stmt, 2, card->id);
+                sqlite3_bind_text(stmt, 3, card->pinHash, -1, SQLITE_STATIC);
+                if (sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(db) == 1) {
+                    memcpy(card->pinHash, pinHash, sizeof(pinHash));
+                    pinCacheStore(cache, card->id, pinHash, pin);
+                }
+            }
+            sqlite3_finalize(stmt);
+            dbWriterRelease();
+        }
+    }
+    return 1;
+}
+
+// Rewrites every plain PIN as a hash. Workers take the next batch of plain rows in
+// id order, hash them in parallel, and write each batch in one short transaction
+// at batch priority; the "pinHash = old" guard skips any row whose PIN changed meanwhile.
+typedef struct {
+    pthread_mutex_t lock;
+    int lastId;
+    int done;
+    long migrated;
+} PinMigration;
+
+static void *pinMigrationWorker(void *arg) {
+    PinMigration *job = arg;
+    int ids[PIN_MIGRATE_BATCH], pins[PIN_MIGRATE_BATCH];
+    char (*hashes)[PIN_HASH_SIZE] = malloc(sizeof(char[PIN_HASH_SIZE]) * PIN_MIGRATE_BATCH);
+    sqlite3 *db = dbReader();
+    sqlite3_stmt *stmt;
+
+    if (hashes == NULL || db == NULL) {
+        free(hashes);
+        return NULL;
+    }
+    while (1) {
+        int count = 0;
+        pthread_mutex_lock(&job->lock);
+        if (!job->done && sqlite3_prepare_v2(db, "SELECT id, pinHash FROM ATM_Cards WHERE id > ? AND pinHash NOT LIKE '$%' "
+                                                 "ORDER BY id LIMIT ?", -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int(stmt, 1, job->lastId);
+            sqlite3_bind_int(stmt, 2, PIN_MIGRATE_BATCH);
+            while (count < PIN_MIGRATE_BATCH && sqlite3_step(stmt) == SQLITE_ROW) {
+                ids[count] = sqlite3_column_int(stmt, 0);
+                pins[count++] = sqlite3_column_int(stmt, 1);
+            }
+            sqlite3_finalize(stmt);
+            if (count == 0) {
+                job->done = 1;
+            } else {
+                job->lastId = ids[count - 1];
+            }
+        }
+        pthread_mutex_unlock(&job->lock);
+        if (count == 0) {
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (!hashPin(pins[i], PIN_HASH_ITERATIONS, hashes[i])) {
+                hashes[i][0] = '\0';
+            }
+        }
+        sqlite3 *writer = dbWriterAcquirePriority(ADMIT_BATCH);
+        if (writer == NULL) {
+            break;
+        }
+        long written = 0;
+        sqlite3_exec(writer, "BEGIN IMMEDIATE", 0, 0, 0);
+        if (sqlite3_prepare_v2(writer, "UPDATE ATM_Cards SET pinHash = ? WHERE id = ? AND pinHash = ?", -1, &stmt, 0) == SQLITE_OK) {
+            for (int i = 0; i < count; i++) {
+                if (hashes[i][0] == '\0') {
+                    continue;
+                }
+                sqlite3_bind_text(stmt, 1, hashes[i], -1, SQLITE_STATIC);
+                sqlite3_bind_int(stmt, 2, ids[i]);
+                sqlite3_bind_int(stmt, 3, pins[i]);
+                if (sqlite3_step(stmt) == SQLITE_DONE) {
+                    written += sqlite3_changes(writer);
+                }
+                sqlite3_reset(stmt);
+            }
+        }
+        sqlite3_finalize(stmt);
+        if (sqlite3_exec(writer, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+            sqlite3_exec(writer, "ROLLBACK", 0, 0, 0);
+            written = 0;
+        }
+        dbWriterRelease();
+
+        pthread_mutex_lock(&job->lock);
+        job->migrated += written;
+        pthread_mutex_unlock(&job->lock);
+    }
+    free(hashes);
+    return NULL;
+}
+
+long migratePins(int threads) {
+    PinMigration job = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0};
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    if (workers == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], 0, pinMigrationWorker, &job);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], 0);
+    }
+    free(workers);
+    return job.migrated;
+}
+
+int fetchCard(int cardId, Card *card) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int found = 0;
+
+    if ((db = dbReader()) == NULL) {
+        return 0;
+    }
+    char sql[100];
+    sprintf(sql, "SELECT id, pinHash, balance, blocked, ownerName, failedAttempts FROM ATM_Cards WHERE id = %d", cardId);
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            card->id = sqlite3_column_int(stmt, 0);
+            snprintf(card->pinHash, sizeof(card->pinHash), "%s", (const char *)sqlite3_column_text(stmt, 1));
+            card->balance = sqlite3_column_double(stmt, 2);
+            card->blocked = sqlite3_column_int(stmt, 3);
+            strcpy(card->ownerName, (const char *)sqlite3_column_text(stmt, 4));
+            card->failedAttempts = sqlite3_column_int(stmt, 5);
+            found = 1;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+void updateBalance(int cardId, double newBalance) {
+    sqlite3 *db;
+    char sql[100];
+
+    if ((db = dbWriterAcquire()) == NULL) {
+        return;
+    }
+    sprintf(sql, "UPDATE ATM_Cards SET balance = %.2f WHERE id = %d", newBalance, cardId);
+    sqlite3_exec(db, sql, 0, 0, 0);
+    dbWriterRelease();
+}
+
+void updatePin(int cardId, int newPin) {
+    if (!isValidPin(newPin)) {
+        printf("Error: PIN must be a 4-digit number.\n");
+        return;
+    }
+
+    if (isWeakPin(newPin)) {
+        printf("Error: PIN is too weak. Choose a stronger PIN.\n");
+        return;
+    }
+
+    if (!storePin(cardId, newPin, NULL)) {
+        printf("Error changing PIN.\n");
+        return;
+    }
+    printf("PIN changed successfully.\n");
+}
+
+// The new hash is also copied to pinHash (PIN_HASH_SIZE bytes) when it is not NULL.
+// Returns 1 once the new PIN is stored.
+int storePin(int cardId, int newPin, char *pinHash) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    char newHash[PIN_HASH_SIZE];
+    int stored = 0;
+
+    // Hash before taking the writer so the slow part never holds up other writes.
+    if (!hashPin(newPin, PIN_HASH_ITERATIONS, newHash) || (db = dbWriterAcquire()) == NULL) {
+        return 0;
+    }
+    if (sqlite3_prepare_v2(db, "UPDATE ATM_Cards SET pinHash = ? WHERE id = ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, newHash, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, cardId);
+        stored = sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(db) == 1;
+    }
+    sqlite3_finalize(stmt);
+    dbWriterRelease();
+    if (stored && pinHash != NULL) {
+        memcpy(pinHash, newHash, PIN_HASH_SIZE);
+    }
+    auditEvent(cardId, AUDIT_PIN_CHANGE, 0, 0, stored);
+    return stored;
+}
+
+void blockCard(int cardId) {
+    sqlite3 *db;
+    char sql[100];
+
+    if ((db = dbWriterAcquirePriority(ADMIT_CRITICAL)) == NULL) {
+        return;
+    }
+    sprintf(sql, "UPDATE ATM_Cards SET blocked = 1 WHERE id = %d", cardId);
+    sqlite3_exec(db, sql, 0, 0, 0);
+    dbWriterRelease();
+    auditEvent(cardId, AUDIT_BLOCK, 0, 0, 1);
+}
+
+// Failed PINs are counted in the card row, so the limit holds across terminals,
+// sessions and processes. The increment and the block happen in one statement
+// under the writer, so concurrent wrong guesses cannot both see a count below the
+// limit. Returns the new count (and updates card), or -1 if it could not be stored.
+int recordFailedPin(Card *card) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int failures = -1;
+
+    if ((db = dbWriterAcquirePriority(ADMIT_CRITICAL)) == NULL) {
+        return -1;
+    }
+    if (sqlite3_prepare_v2(db, "UPDATE ATM_Cards SET failedAttempts = failedAttempts + 1, "
+                               "blocked = IIF(failedAttempts + 1 >= ?2, 1, blocked) "
+                               "WHERE id = ?1 RETURNING failedAttempts, blocked", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, card->id);
+        sqlite3_bind_int(stmt, 2, PIN_MAX_ATTEMPTS);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            failures = sqlite3_column_int(stmt, 0);
+            card->blocked = sqlite3_column_int(stmt, 1);
+        }
+    }
+    sqlite3_finalize(stmt);
+    dbWriterRelease();
+    if (failures < 0) {
+        return -1;
+    }
+    card->failedAttempts = failures;
+    if (failures == PIN_MAX_ATTEMPTS) {
+        auditEvent(card->id, AUDIT_BLOCK, 0, 0, 1);
+    }
+    return failures;
+}
+
+// A PIN is checked against the card as it was loaded, which can be stale by the
+// time the check finishes: another terminal may have blocked the card or changed
+// the PIN. The login is decided again from a fresh read, which costs no write and
+// cannot be shed. Only a card with failures to reset takes the writer, at blocking
+// priority, and the reset itself repeats the check so a block in between still
+// wins. Returns 1 if the login stands, 0 if the card is now blocked or has a
+// different PIN (card is refreshed either way), and -1 if it could not be read.
+int acceptPin(Card *card) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    Card current;
+    int accepted, reset = -1;
+
+    if (!fetchCard(card->id, &current)) {
+        return -1;
+    }
+    accepted = !current.blocked && strcmp(current.pinHash, card->pinHash) == 0;
+    if (accepted && current.failedAttempts > 0) {
+        if ((db = dbWriterAcquirePriority(ADMIT_CRITICAL)) == NULL) {
+            return -1;
+        }
+        if (sqlite3_prepare_v2(db, "UPDATE ATM_Cards SET failedAttempts = 0 WHERE id = ? AND blocked = 0 AND pinHash = ?",
+                               -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int(stmt, 1, card->id);
+            sqlite3_bind_text(stmt, 2, card->pinHash, -1, SQLITE_STATIC);
+            reset = sqlite3_step(stmt) == SQLITE_DONE ? sqlite3_changes(db) : -1;
+        }
+        sqlite3_finalize(stmt);
+        dbWriterRelease();
+        if (reset < 0) {
+            return -1;
+        }
+        if (reset == 0 && !fetchCard(card->id, &current)) { // Changed since the read
+            return -1;
+        }
+        accepted = reset;
+        current.failedAttempts = reset ? 0 : current.failedAttempts;
+    }
+    *card = current;
+    return accepted;
+}
+
+void contactBank(int cardId) {
+    char name[50] = "";
+    printf("Enter your full name to unblock the card: ");
+    scanf(" %49[^\n]", name);
+
+    if (unblockCard(cardId, name)) {
+        printf("Card unblocked successfully.\n");
+    } else {
+        printf("Incorrect name. Card remains blocked.\n");
+    }
+}
+
+int unblockCard(int cardId, const char *name) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int found = 0;
+
+    if ((db = dbReader()) == NULL) {
+        return 0;
+    }
+    char sql[100];
+    sprintf(sql, "SELECT ownerName FROM ATM_Cards WHERE id = %d", cardId);
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *storedName = (const char *)sqlite3_column_text(stmt, 0);
+            if (strcmp(storedName, name) == 0) {
+                found = 1;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (found && (db = dbWriterAcquire()) != NULL) {
+        sprintf(sql, "UPDATE ATM_Cards SET blocked = 0, failedAttempts = 0 WHERE id = %d", cardId);
+        sqlite3_exec(db, sql, 0, 0, 0);
+        dbWriterRelease();
+        auditEvent(cardId, AUDIT_UNBLOCK, 0, 0, 1);
+        return 1;
+    }
+    auditEvent(cardId, AUDIT_UNBLOCK, 0, 0, 0);
+    return 0;
+}
+
+// Owner search for help-desk staff. ATM_OwnerIndex is an external-content FTS5 index
+// over ATM_Cards.ownerName (unicode61 folds case and diacritics), with prefix indexes
+// so "jo sm" finds "John Smith" without a table scan. Fuzzy search first maps each
+// query word to the closest name words within a small edit distance, drawn from the
+// best-ranked names sharing a trigram with it in ATM_OwnerGrams, then runs the same
+// indexed query with those words OR-ed together.
+// Edit distance counting adjacent transpositions as one edit ("jsoe" -> "jose"),
+// abandoned as soon as every cell in a row exceeds the limit.
+static int boundedEditDistance(const char *a, int lengthA, const char *b, int lengthB, int limit) {
+    int rows[3][OWNER_TERM_MAX + 1];
+
+    if (abs(lengthA - lengthB) > limit || lengthB > OWNER_TERM_MAX) {
+        return limit + 1;
+    }
+    for (int j = 0; j <= lengthB; j++) {
+        rows[0][j] = j;
+    }
+    for (int i = 1; i <= lengthA; i++) {
+        int *row = rows[i % 3], *previous = rows[(i - 1) % 3], *before = rows[(i + 1) % 3];
+        int best = row[0] = i;
+        for (int j = 1; j <= lengthB; j++) {
+            int cost = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            if (previous[j] + 1 < cost) {
+                cost = previous[j] + 1;
+            }
+            if (row[j - 1] + 1 < cost) {
+                cost = row[j - 1] + 1;
+            }
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && before[j - 2] + 1 < cost) {
+                cost = before[j - 2] + 1;
+            }
+            row[j] = cost;
+            if (cost < best) {
+                best = cost;
+            }
+        }
+        if (best > limit) {
+            return limit + 1;
+        }
+    }
+    return rows[lengthA % 3][lengthB];
+}
+
+// Reads the next word of a name or query: letters and digits (any byte from 0x80
+// up, so UTF-8 letters stay whole), lower-cased, and cut at OWNER_TERM_MAX bytes.
+// Returns its length, or 0 at the end of the text.
+static int nextOwnerWord(const char **cursor, char *word) {
+    const unsigned char *p = (const unsigned char *)*cursor;
+    int length = 0;
+
+    while (*p != '\0' && !(*p >= 0x80 || (*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))) {
+        p++;
+    }
+    for (; *p >= 0x80 || (*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'); p++) {
+        if (length < OWNER_TERM_MAX) {
+            word[length++] = (char)(*p >= 'A' && *p <= 'Z' ? *p + 32 : *p);
+        }
+    }
+    word[length] = '\0';
+    *cursor = (const char *)p;
+    return length;
+}
+
+// Appends text to the MATCH expression, or leaves it unchanged and returns 0 if the
+// text does not fit.
+static int appendMatch(char *match, size_t size, const char *text) {
+    size_t used = strlen(match), length = strlen(text);
+
+    if (used + length >= size) {
+        return 0;
+    }
+    memcpy(match + used, text, length + 1);
+    return 1;
+}
+
+typedef struct {
+    char term[OWNER_TERM_MAX + 1];
+    int distance;
+} OwnerCandidate;
+
+// Collects the name words closest to word, nearest first, from the names that share
+// the most trigrams with it. Only the doclists of the word's own trigrams are read,
+// and at most OWNER_FUZZY_CANDIDATES names are examined. Returns the number kept.
+static int closestOwnerTerms(sqlite3 *db, const char *word, OwnerCandidate *closest) {
+    sqlite3_stmt *stmt;
+    char grams[OWNER_TERM_MAX * 8] = "";
+    char term[OWNER_TERM_MAX + 1];
+    int length = (int)strlen(word);
+    int limit = length <= 4 ? 1 : 2;
+    int kept = 0;
+
+    // One quoted trigram per character position; UTF-8 continuation bytes never
+    // start a gram, so each gram is three whole characters.
+    for (int start = 0; start < length; start++) {
+        int end = start, chars = 0;
+        if (((unsigned char)word[start] & 0xC0) == 0x80) {
+            continue;
+        }
+        while (end < length && chars < 3) {
+            end++;
+            while (end < length && ((unsigned char)word[end] & 0xC0) == 0x80) {
+                end++;
+            }
+            chars++;
+        }
+        if (chars < 3) {
+            break;
+        }
+        size_t used = strlen(grams);
+        snprintf(grams + used, sizeof(grams) - used, "%s\"%.*s\"", used > 0 ? " OR " : "", end - start, word + start);
+    }
+    if (grams[0] == '\0') {
+        return 0;
+    }
+
+    if (sqlite3_prepare_v2(db, "SELECT ownerName FROM ATM_OwnerGrams WHERE ATM_OwnerGrams MATCH ? ORDER BY rank LIMIT ?",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, grams, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, OWNER_FUZZY_CANDIDATES);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *cursor = (const char *)sqlite3_column_text(stmt, 0);
+        int termLength;
+        while (cursor != NULL && (termLength = nextOwnerWord(&cursor, term)) > 0) {
+            int distance = boundedEditDistance(word, length, term, termLength, limit);
+            int at = kept, duplicate = 0;
+            if (distance > limit) {
+                continue;
+            }
+            for (int i = 0; i < kept; i++) {
+                duplicate |= strcmp(closest[i].term, term) == 0;
+            }
+            if (duplicate) {
+                continue;
+            }
+            // Insertion into the list kept sorted by distance, dropping the farthest
+            // once it is full.
+            while (at > 0 && closest[at - 1].distance > distance) {
+                at--;
+            }
+            if (at >= OWNER_FUZZY_TERMS) {
+                continue;
+            }
+            if (kept < OWNER_FUZZY_TERMS) {
+                kept++;
+            }
+            memmove(&closest[at + 1], &closest[at], (size_t)(kept - 1 - at) * sizeof(*closest));
+            memcpy(closest[at].term, term, (size_t)termLength + 1);
+            closest[at].distance = distance;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return kept;
+}
+
+// Appends one query word to the MATCH expression, as a prefix term or, when fuzzy,
+// as the set of name words closest to it. Returns 0 if nothing could match and -1 if
+// the expression no longer fits in size bytes.
+static int appendOwnerTerm(sqlite3 *db, char *match, size_t size, const char *word, int fuzzy) {
+    OwnerCandidate closest[OWNER_FUZZY_TERMS];
+    int kept;
+
+    if (match[0] != '\0' && !appendMatch(match, size, " AND ")) {
+        return -1;
+    }
+    if (!fuzzy) {
+        return appendMatch(match, size, "\"") && appendMatch(match, size, word) && appendMatch(match, size, "\"*") ? 1 : -1;
+    }
+
+    if ((kept = closestOwnerTerms(db, word, closest)) == 0) {
+        return 0;
+    }
+    if (!appendMatch(match, size, "(")) {
+        return -1;
+    }
+    for (int i = 0; i < kept; i++) {
+        if (!appendMatch(match, size, i > 0 ? " OR \"" : "\"") || !appendMatch(match, size, closest[i].term) ||
+            !appendMatch(match, size, "\"")) {
+            return -1;
+        }
+    }
+    return appendMatch(match, size, ")") ? 1 : -1;
+}
+
+int searchOwners(const char *query, int fuzzy, int *cardIds, int max) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    char match[4096] = "";
+    char word[OWNER_TERM_MAX + 1];
+    int found = 0;
+
+    if ((db = dbReader()) == NULL) {
+        return -1;
+    }
+    // Split on anything that is not a letter or digit, so user input never reaches
+    // the FTS5 query syntax. A query too long for the expression is refused whole
+    // rather than searched on a prefix of its words.
+    for (const char *cursor = query; nextOwnerWord(&cursor, word) > 0;) {
+        int appended = appendOwnerTerm(db, match, sizeof(match), word, fuzzy);
+        if (appended < 0) {
+            printf("Search query is too long.\n");
+            return -1;
+        }
+        if (appended == 0) {
+            return 0;
+        }
+    }
+    if (match[0] == '\0') {
+        return 0;
+    }
+
+    if (sqlite3_prepare_v2(db, "SELECT rowid FROM ATM_OwnerIndex WHERE ATM_OwnerIndex MATCH ? ORDER BY rank LIMIT ?",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        return -1;
+    }
+    sqlite3_bind_text(stmt, 1, match, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, max);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        cardIds[found++] = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+int fetchCardStats(CardStats *stats) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int found = 0;
+
+    if ((db = dbReader()) == NULL) {
+        return 0;
+    }
+    if (sqlite3_prepare_v2(db, "SELECT cards, blockedCards, totalBalance, deposits, withdrawals FROM ATM_Stats WHERE id = 1",
+                           -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            stats->cards = sqlite3_column_int64(stmt, 0);
+            stats->blockedCards = sqlite3_column_int64(stmt, 1);
+            stats->totalBalance = sqlite3_column_double(stmt, 2);
+            stats->deposits = sqlite3_column_double(stmt, 3);
+            stats->withdrawals = sqlite3_column_double(stmt, 4);
+            found = 1;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+int runStats(int top) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    CardStats stats;
+
+    if (!fetchCardStats(&stats) || (db = dbReader()) == NULL) {
+        printf("Error reading statistics.\n");
+        return 1;
+    }
+    printf("Cards: %lld (%lld blocked)\n", stats.cards, stats.blockedCards);
+    printf("Total balance: £%.2f\n", stats.totalBalance);
+    printf("Deposits: £%.2f  Withdrawals: £%.2f\n", stats.deposits, stats.withdrawals);
+
+    printf("\nToday by terminal:\n");
+    sqlite3_prepare_v2(db, "SELECT terminalId, transactions, credited, debited FROM ATM_TerminalDaily "
+                           "WHERE day = ? ORDER BY terminalId", -1, &stmt, 0);
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)time(NULL) / 86400);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        printf("  Terminal %d: %lld transactions, £%.2f in, £%.2f out\n", sqlite3_column_int(stmt, 0),
+               (long long)sqlite3_column_int64(stmt, 1), sqlite3_column_double(stmt, 2), sqlite3_column_double(stmt, 3));
+    }
+    sqlite3_finalize(stmt);
+
+    printf("\nTop %d balances:\n", top);
+    sqlite3_prepare_v2(db, "SELECT id, balance FROM ATM_Cards ORDER BY balance DESC LIMIT ?", -1, &stmt, 0);
+    sqlite3_bind_int(stmt, 1, top);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        printf("  %d: £%.2f\n", sqlite3_column_int(stmt, 0), sqlite3_column_double(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+// Column store for bulk scans. Each card field lives in its own array, so a scan
+// over balances or blocked flags touches only those bytes and the loops vectorise.
+// Balances are kept in pence so sums are exact integer adds. Owner names are
+// interned: each distinct name is stored once in an arena and cards carry a
+// 32-bit name id. PINs are deliberately not copied into the store.
+static int cardColumnsGrow(CardColumns *columns) {
+    size_t capacity = columns->capacity ? columns->capacity * 2 : 4096;
+    int32_t *ids = realloc(columns->ids, capacity * sizeof(int32_t));
+    if (ids != NULL) {
+        columns->ids = ids;
+    }
+    int64_t *balancePence = realloc(columns->balancePence, capacity * sizeof(int64_t));
+    if (balancePence != NULL) {
+        columns->balancePence = balancePence;
+    }
+    uint8_t *blocked = realloc(columns->blocked, capacity);
+    if (blocked != NULL) {
+        columns->blocked = blocked;
+    }
+    uint32_t *nameIds = realloc(columns->nameIds, capacity * sizeof(uint32_t));
+    if (nameIds != NULL) {
+        columns->nameIds = nameIds;
+    }
+    if (ids == NULL || balancePence == NULL || blocked == NULL || nameIds == NULL) {
+        return -1;
+    }
+    columns->capacity = capacity;
+    return 0;
+}
+
+static uint32_t nameHash(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int64_t internName(CardColumns *columns, const char *name, size_t length) {
+    if (columns->nameCount * 2 >= columns->nameSlotCount) {
+        size_t slotCount = columns->nameSlotCount ? columns->nameSlotCount * 2 : 1024;
+        uint32_t *slots = calloc(slotCount, sizeof(uint32_t));
+        if (slots == NULL) {
+            return -1;
+        }
+        for (uint32_t id = 0; id < columns->nameCount; id++) {
+            const char *existing = columns->names + columns->nameOffsets[id];
+            size_t slot = nameHash(existing, strlen(existing)) & (slotCount - 1);
+            while (slots[slot] != 0) {
+                slot = (slot + 1) & (slotCount - 1);
+            }
+            slots[slot] = id + 1;
+        }
+        free(columns->nameSlots);
+        columns->nameSlots = slots;
+        columns->nameSlotCount = slotCount;
+    }
+
+    size_t slot = nameHash(name, length) & (columns->nameSlotCount - 1);
+    while (columns->nameSlots[slot] != 0) {
+        const char *existing = columns->names + columns->nameOffsets[columns->nameSlots[slot] - 1];
+        if (strncmp(existing, name, length) == 0 && existing[length] == '\0') {
+            return columns->nameSlots[slot] - 1;
+        }
+        slot = (slot + 1) & (columns->nameSlotCount - 1);
+    }
+
+    if (columns->namesUsed + length + 1 > columns->namesCapacity) {
+        size_t capacity = columns->namesCapacity ? columns->namesCapacity * 2 : 65536;
+        while (capacity < columns->namesUsed + length + 1) {
+            capacity *= 2;
+        }
+        char *names = realloc(columns->names, capacity);
+        if (names == NULL) {
+            return -1;
+        }
+        columns->names = names;
+        columns->namesCapacity = capacity;
+    }
+    if (columns->nameCount == UINT32_MAX - 1) { // Name ids and slots are 32-bit
+        return -1;
+    }
+    if (columns->nameCount % 1024 == 0) {
+        uint64_t *offsets = realloc(columns->nameOffsets, (columns->nameCount + 1024) * sizeof(uint64_t));
+        if (offsets == NULL) {
+            return -1;
+        }
+        columns->nameOffsets = offsets;
+    }
+    memcpy(columns->names + columns->namesUsed, name, length);
+    columns->names[columns->namesUsed + length] = '\0';
+    columns->nameOffsets[columns->nameCount] = columns->namesUsed;
+    columns->namesUsed += length + 1;
+    columns->nameSlots[slot] = columns->nameCount + 1;
+    return columns->nameCount++;
+}
+
+// Loads every card, or none: a store that ran out of memory or hit a read error
+// part way is freed rather than returned as if it held every card.
+int cardColumnsLoad(CardColumns *columns) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int rc;
+
+    memset(columns, 0, sizeof(*columns));
+    if ((db = dbReader()) == NULL ||
+        sqlite3_prepare_v2(db, "SELECT id, balance, blocked, ownerName FROM ATM_Cards ORDER BY id", -1, &stmt, 0) != SQLITE_OK) {
+        return -1;
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (columns->count == columns->capacity && cardColumnsGrow(columns) != 0) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        const char *name = (const char *)sqlite3_column_text(stmt, 3);
+        int64_t nameId = internName(columns, name ? name : "", (size_t)sqlite3_column_bytes(stmt, 3));
+        if (nameId < 0) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        size_t i = columns->count++;
+        columns->ids[i] = sqlite3_column_int(stmt, 0);
+        columns->balancePence[i] = llround(sqlite3_column_double(stmt, 1) * 100);
+        columns->blocked[i] = sqlite3_column_int(stmt, 2) != 0;
+        columns->nameIds[i] = (uint32_t)nameId;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        cardColumnsFree(columns);
+        return -1;
+    }
+    return (int)(columns->count > INT_MAX ? INT_MAX : columns->count);
+}
+
+void cardColumnsFree(CardColumns *columns) {
+    free(columns->ids);
+    free(columns->balancePence);
+    free(columns->blocked);
+    free(columns->nameIds);
+    free(columns->names);
+    free(columns->nameOffsets);
+    free(columns->nameSlots);
+    memset(columns, 0, sizeof(*columns));
+}
+
+const char *cardColumnsName(const CardColumns *columns, size_t index) {
+    return columns->names + columns->nameOffsets[columns->nameIds[index]];
+}
+
+int64_t cardColumnsSumBalances(const CardColumns *columns) {
+    const int64_t *restrict balances = columns->balancePence;
+    int64_t total = 0;
+    for (size_t i = 0; i < columns->count; i++) {
+        total += balances[i];
+    }
+    return total;
+}
+
+size_t cardColumnsCountBlocked(const CardColumns *columns) {
+    const uint8_t *restrict blocked = columns->blocked;
+    size_t count = 0;
+    // Byte counters are flushed every 255 cards so the inner loop stays 8 bits wide.
+    for (size_t start = 0; start < columns->count; start += 255) {
+        size_t end = start + 255 < columns->count ? start + 255 : columns->count;
+        uint8_t partial = 0;
+        for (size_t i = start; i < end; i++) {
+            partial += blocked[i];
+        }
+        count += partial;
+    }
+    return count;
+}
+
+int runCardScan() {
+    CardColumns columns;
+    struct timespec start, loaded, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (cardColumnsLoad(&columns) < 0) {
+        printf("Error loading cards.\n");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &loaded);
+    int64_t total = cardColumnsSumBalances(&columns);
+    size_t blocked = cardColumnsCountBlocked(&columns);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double loadSeconds = (loaded.tv_sec - start.tv_sec) + (loaded.tv_nsec - start.tv_nsec) / 1e9;
+    double scanSeconds = (end.tv_sec - loaded.tv_sec) + (end.tv_nsec - loaded.tv_nsec) / 1e9;
+    double bytes = (double)columns.count * (sizeof(int64_t) + sizeof(uint8_t));
+    printf("Cards: %zu (%zu blocked), %u distinct names\n", columns.count, blocked, columns.nameCount);
+    printf("Total balance: £%.2f\n", total / 100.0);
+    printf("Loaded in %.3fs, scanned in %.6fs (%.2f GB/s)\n", loadSeconds, scanSeconds,
+           scanSeconds > 0 ? bytes / scanSeconds / 1e9 : 0.0);
+    cardColumnsFree(&columns);
+    return 0;
+}
+
+// Online backup. Pages are copied from the writer connection a few at a time,
+// each step under writerLock at batch priority, so customers never wait behind
+// more than one short step. Because the source is the writer connection itself,
+// commits made between steps are applied to the copy as they happen instead of
+// restarting the backup (commits from other processes still restart it). The copy
+// goes to a temporary file and only replaces the destination after it verifies.
+int verifyBackup(const char *path) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int ok = 0;
+
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK) {
+        printf("Error opening backup %s.\n", path);
+        sqlite3_close(db);
+        return 1;
+    }
+    if (sqlite3_prepare_v2(db, "PRAGMA integrity_check", -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *result = (const char *)sqlite3_column_text(stmt, 0);
+        ok = strcmp(result, "ok") == 0;
+        if (!ok) {
+            printf("Integrity check failed: %s\n", result);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    // The aggregates are maintained by triggers in the same transactions as the
+    // cards, so in a consistent copy they must agree with a fresh count.
+    if (ok && sqlite3_prepare_v2(db, "SELECT s.cards, s.totalBalance, c.cards, c.totalBalance FROM ATM_Stats s, "
+                                     "(SELECT COUNT(*) AS cards, IFNULL(SUM(balance), 0) AS totalBalance FROM ATM_Cards) c",
+                                 -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        long long cards = sqlite3_column_int64(stmt, 2);
+        double total = sqlite3_column_double(stmt, 3);
+        if (sqlite3_column_int64(stmt, 0) != cards || fabs(sqlite3_column_double(stmt, 1) - total) > 0.005) {
+            printf("Card totals do not match: %lld cards, £%.2f expected; %lld cards, £%.2f found\n",
+                   (long long)sqlite3_column_int64(stmt, 0), sqlite3_column_double(stmt, 1), cards, total);
+            ok = 0;
+        } else {
+            printf("Backup %s verified: %lld cards, £%.2f\n", path, cards, total);
+        }
+    } else if (ok) {
+        printf("Backup %s has no card statistics.\n", path);
+        ok = 0;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return ok ? 0 : 1;
+}
+
+int runBackup(const char *destPath, int pagesPerStep, int pauseMs) {
+    char tempPath[300];
+    sqlite3 *dest;
+    sqlite3_backup *backup = NULL;
+    int rc = SQLITE_OK;
+    int steps = 0;
+
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", destPath);
+    unlink(tempPath);
+    if (sqlite3_open(tempPath, &dest) != SQLITE_OK) {
+        printf("Error creating %s.\n", tempPath);
+        sqlite3_close(dest);
+        return 1;
+    }
+
+    while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        sqlite3 *db = dbWriterAcquirePriority(ADMIT_BATCH);
+        if (db == NULL) {
+            rc = SQLITE_ERROR;
+            break;
+        }
+        if (backup == NULL && (backup = sqlite3_backup_init(dest, "main", db, "main")) == NULL) {
+            dbWriterRelease();
+            rc = SQLITE_ERROR;
+            break;
+        }
+        rc = sqlite3_backup_step(backup, pagesPerStep);
+        int remaining = sqlite3_backup_remaining(backup);
+        int total = sqlite3_backup_pagecount(backup);
+        dbWriterRelease();
+
+        if (++steps % BACKUP_REPORT_STEPS == 0 && total > 0) {
+            printf("Backup %d%% (%d of %d pages)\n", (total - remaining) * 100 / total, total - remaining, total);
+            fflush(stdout);
+        }
+        if (rc != SQLITE_DONE) {
+            usleep((useconds_t)pauseMs * 1000);
+        }
+    }
+
+    // backup_finish must run while no other thread is using the source connection.
+    pthread_mutex_lock(&writerLock);
+    if (sqlite3_backup_finish(backup) != SQLITE_OK && rc == SQLITE_DONE) {
+        rc = SQLITE_ERROR;
+    }
+    pthread_mutex_unlock(&writerLock);
+    if (rc != SQLITE_DONE) {
+        printf("Backup failed: %s\n", sqlite3_errmsg(dest));
+        sqlite3_close(dest);
+        unlink(tempPath);
+        return 1;
+    }
+    sqlite3_close(dest);
+
+    if (verifyBackup(tempPath) != 0 || rename(tempPath, destPath) != 0) {
+        printf("Backup left in %s for inspection; %s not replaced.\n", tempPath, destPath);
+        return 1;
+    }
+    printf("Backup written to %s in %d step(s).\n", destPath, steps);
+    return 0;
+}
+
+// Ledger archival. Rows older than the cutoff move in batches into one database
+// file per calendar month (UTC), so the hot ledger holds only recent history and
+// the pages it frees are reused by new rows instead of growing the file. Each batch
+// is committed to the archive first and then deleted from the hot ledger in a
+// second transaction that also records the month in ATM_Archives. WAL commits are
+// not atomic across attached files, so the copy skips rows the month file already
+// holds unchanged: a crash between the two steps leaves rows in both places and the
+// next run finishes the move. A different row under the same id fails the batch
+// rather than being dropped. The writer is released between batches so customers
+// interleave.
+// ATTACH inherits the main database's VFS, which is memdb under ATM_DB=:memory:,
+// so plain paths are always named by a URI on the default (file) VFS.
+static int attachDatabase(sqlite3 *db, const char *path, const char *schema, int readOnly) {
+    sqlite3_stmt *stmt;
+    char uri[PATH_MAX * 3 + 64];
+    size_t used = (size_t)snprintf(uri, sizeof(uri), "file:");
+    char *sql = sqlite3_mprintf("ATTACH ? AS \"%w\"", schema);
+    int rc = sql != NULL ? sqlite3_prepare_v2(db, sql, -1, &stmt, 0) : SQLITE_NOMEM;
+
+    sqlite3_free(sql);
+    if (strncmp(path, "file:", 5) == 0) {
+        // Already a URI (the shared in-memory database); it names its own VFS.
+        snprintf(uri, sizeof(uri), "%s", path);
+    } else {
+        for (const char *p = path; *p != '\0' && used + 4 < sizeof(uri); p++) {
+            if (*p == '%' || *p == '?' || *p == '#') {
+                used += (size_t)snprintf(uri + used, sizeof(uri) - used, "%%%02X", (unsigned char)*p);
+            } else {
+                uri[used++] = *p;
+            }
+        }
+        snprintf(uri + used, sizeof(uri) - used, "?vfs=%s%s", sqlite3_vfs_find(NULL)->zName, readOnly ? "&mode=ro" : "");
+    }
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, uri, -1, SQLITE_TRANSIENT);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static int archiveBatch(sqlite3 *db, const char *path, int month, long long first, long long upper,
+                        long long lastTimestamp, int lastId) {
+    sqlite3_stmt *stmt;
+    char resolved[PATH_MAX];
+    int moved = -1;
+
+    if (attachDatabase(db, path, "archive", 0) != SQLITE_OK) {
+        printf("Error opening archive %s: %s\n", path, sqlite3_errmsg(db));
+        return -1;
+    }
+    if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS archive.ATM_Transactions ("
+                         "id INTEGER PRIMARY KEY, "
+                         "cardId INTEGER, "
+                         "terminalId INTEGER, "
+                         "type TEXT, "
+                         "amount REAL, "
+                         "oldBalance REAL, "
+                         "newBalance REAL, "
+                         "timestamp INTEGER);"
+                         "CREATE INDEX IF NOT EXISTS archive.idx_archive_card_time "
+                         "ON ATM_Transactions(cardId, timestamp, id);",
+                     0, 0, 0) != SQLITE_OK) {
+        printf("SQL Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "DETACH archive", 0, 0, 0);
+        return -1;
+    }
+    if (realpath(path, resolved) == NULL) {
+        snprintf(resolved, sizeof(resolved), "%s", path);
+    }
+
+    const char *copySql = "INSERT INTO archive.ATM_Transactions "
+                          "(id, cardId, terminalId, type, amount, oldBalance, newBalance, timestamp) "
+                          "SELECT id, cardId, terminalId, type, amount, oldBalance, newBalance, timestamp "
+                          "FROM main.ATM_Transactions AS hot WHERE timestamp < ?1 AND (timestamp, id) <= (?2, ?3) "
+                          "AND NOT EXISTS (SELECT 1 FROM archive.ATM_Transactions AS copied WHERE copied.id = hot.id "
+                          "AND copied.cardId IS hot.cardId AND copied.terminalId IS hot.terminalId "
+                          "AND copied.type IS hot.type AND copied.amount IS hot.amount "
+                          "AND copied.oldBalance IS hot.oldBalance AND copied.newBalance IS hot.newBalance "
+                          "AND copied.timestamp IS hot.timestamp)";
+    const char *deleteSql = "DELETE FROM main.ATM_Transactions WHERE timestamp < ?1 AND (timestamp, id) <= (?2, ?3)";
+    const char *steps[] = {copySql, deleteSql};
+    for (int i = 0; i < 2; i++) {
+        sqlite3_exec(db, i == 0 ? "BEGIN" : "BEGIN IMMEDIATE", 0, 0, 0);
+        if (sqlite3_prepare_v2(db, steps[i], -1, &stmt, 0) != SQLITE_OK) {
+            break;
+        }
+        sqlite3_bind_int64(stmt, 1, upper);
+        sqlite3_bind_int64(stmt, 2, lastTimestamp);
+        sqlite3_bind_int(stmt, 3, lastId);
+        int rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            break;
+        }
+        if (i == 1) {
+            moved = sqlite3_changes(db);
+            if (sqlite3_prepare_v2(db, "INSERT INTO ATM_Archives (month, path, rows, firstTimestamp, lastTimestamp) "
+                                       "VALUES (?, ?, ?, ?, ?) ON CONFLICT DO UPDATE SET path = excluded.path, "
+                                       "rows = rows + excluded.rows, "
+                                       "firstTimestamp = MIN(firstTimestamp, excluded.firstTimestamp), "
+                                       "lastTimestamp = MAX(lastTimestamp, excluded.lastTimestamp)",
+                                   -1, &stmt, 0) != SQLITE_OK) {
+                moved = -1;
+                break;
+            }
+            sqlite3_bind_int(stmt, 1, month);
+            sqlite3_bind_text(stmt, 2, resolved, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 3, moved);
+            sqlite3_bind_int64(stmt, 4, first);
+            sqlite3_bind_int64(stmt, 5, lastTimestamp);
+            rc = sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+            if (rc != SQLITE_DONE) {
+                moved = -1;
+                break;
+            }
+        }
+        if (sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+            moved = -1;
+            break;
+        }
+    }
+    if (moved < 0) {
+        printf("SQL Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    }
+    sqlite3_exec(db, "DETACH archive", 0, 0, 0);
+    return moved;
+}
+
+long long archiveLedger(const char *dir, long long cutoff) {
+    const char *oldestSql = "SELECT timestamp, CAST(strftime('%Y%m', timestamp, 'unixepoch') AS INTEGER), "
+                            "CAST(strftime('%s', timestamp, 'unixepoch', 'start of month', '+1 month') AS INTEGER) "
+                            "FROM ATM_Transactions WHERE timestamp < ? ORDER BY timestamp, id LIMIT 1";
+    const char *lastSql = "SELECT timestamp, id FROM (SELECT timestamp, id FROM ATM_Transactions WHERE timestamp < ?1 "
+                          "ORDER BY timestamp, id LIMIT ?2) ORDER BY timestamp DESC, id DESC LIMIT 1";
+    long long archived = 0;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        printf("Error creating archive directory %s.\n", dir);
+        return -1;
+    }
+    while (1) {
+        sqlite3 *db = dbWriterAcquirePriority(ADMIT_BATCH);
+        sqlite3_stmt *stmt;
+        long long first = 0, upper = 0, lastTimestamp = 0;
+        int month = 0, lastId = 0;
+
+        if (db == NULL) {
+            return -1;
+        }
+        if (sqlite3_prepare_v2(db, oldestSql, -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, cutoff);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                first = sqlite3_column_int64(stmt, 0);
+                month = sqlite3_column_int(stmt, 1);
+                upper = sqlite3_column_int64(stmt, 2);
+            }
+        }
+        sqlite3_finalize(stmt);
+        if (month == 0) {
+            dbWriterRelease();
+            break;
+        }
+        if (upper > cutoff) {
+            upper = cutoff;
+        }
+        if (sqlite3_prepare_v2(db, lastSql, -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, upper);
+            sqlite3_bind_int(stmt, 2, ARCHIVE_BATCH);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                lastTimestamp = sqlite3_column_int64(stmt, 0);
+                lastId = sqlite3_column_int(stmt, 1);
+            }
+        }
+        sqlite3_finalize(stmt);
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/ledger-%04d-%02d.db", dir, month / 100, month % 100);
+        int moved = archiveBatch(db, path, month, first, upper, lastTimestamp, lastId);
+        dbWriterRelease();
+        if (moved <= 0) {
+            return moved < 0 ? -1 : archived;
+        }
+        archived += moved;
+    }
+    return archived;
+}
+
+int runArchive(const char *dir, int keepDays) {
+    long long cutoff = (long long)time(NULL) - (long long)keepDays * 86400;
+    long long archived = archiveLedger(dir, cutoff);
+
+    if (archived < 0) {
+        printf("Archival stopped; rows already moved stay archived and the rest move on the next run.\n");
+        return 1;
+    }
+    printf("Archived %lld transaction(s) older than %d day(s) into %s.\n", archived, keepDays, dir);
+    return 0;
+}
+
+int runOwnerSearch(const char *query, int fuzzy) {
+    int cardIds[OWNER_SEARCH_LIMIT];
+    int found = searchOwners(query, fuzzy, cardIds, OWNER_SEARCH_LIMIT);
+    Card card;
+
+    if (found < 0) {
+        printf("Error searching card owners.\n");
+        return 1;
+    }
+    for (int i = 0; i < found; i++) {
+        if (fetchCard(cardIds[i], &card)) {
+            printf("%d  %-40s %s\n", card.id, card.ownerName, card.blocked ? "blocked" : "active");
+        }
+    }
+    printf("%d match(es)\n", found);
+    return 0;
+}
+
+void insertTransaction(sqlite3 *db, int cardId, const char *transactionType, double amount, double oldBalance, double newBalance) {
+    sqlite3_stmt *stmt;
+    const char *sql = "INSERT INTO ATM_Transactions "
+                      "(cardId, terminalId, type, amount, oldBalance, newBalance, timestamp) "
+                      "VALUES (?, ?, ?, ?, ?, ?, ?)";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, cardId);
+        sqlite3_bind_int(stmt, 2, currentTerminal());
+        sqlite3_bind_text(stmt, 3, transactionType, -1, SQLITE_STATIC);
+        sqlite3_bind_double(stmt, 4, amount);
+        sqlite3_bind_double(stmt, 5, oldBalance);
+        sqlite3_bind_double(stmt, 6, newBalance);
+        sqlite3_bind_int64(stmt, 7, (sqlite3_int64)time(NULL));
+        sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+}
+
+void recordTransaction(int cardId, const char *transactionType, double amount, double oldBalance, double newBalance) {
+    sqlite3 *db;
+
+    if ((db = dbWriterAcquire()) == NULL) {
+        return;
+    }
+    insertTransaction(db, cardId, transactionType, amount, oldBalance, newBalance);
+    dbWriterRelease();
+}
+
+// Requests already seen are answered from a fixed-size, direct-mapped cache and,
+// when that misses, from ATM_Requests, which is written in the same transaction as
+// the balance change it describes. Both are keyed on (card, request id), so two
+// terminals that happen to pick the same id for different cards never meet; a
+// repeated id on the same card must also repeat the operation and amount, or the
+// request is rejected as TX_INVALID instead of being answered with another outcome.
+typedef struct {
+    long long requestId;
+    int cardId;
+    int result;
+    char type[16];
+    double amount;
+    double oldBalance;
+    double newBalance;
+} RequestRecord;
+
+RequestRecord requestCache[DEDUPE_SLOTS];
+pthread_mutex_t requestCacheLock = PTHREAD_MUTEX_INITIALIZER;
+long long requestCounter = 0;
+
+int currentTerminal() {
+    return sessionTerminal != 0 ? sessionTerminal : terminalId;
+}
+
+// The sequence starts at a random point in each process, so two consoles sharing a
+// terminal id and a second do not mint the same ids.
+static void seedRequestCounter() {
+    uint16_t seed = 0;
+    if (getrandom(&seed, sizeof(seed), 0) == (ssize_t)sizeof(seed)) {
+        requestCounter = seed;
+    }
+}
+
+long long newRequestId() {
+    static pthread_once_t seeded = PTHREAD_ONCE_INIT;
+    pthread_once(&seeded, seedRequestCounter);
+    pthread_mutex_lock(&requestCacheLock);
+    long long sequence = ++requestCounter & 0xffff;
+    pthread_mutex_unlock(&requestCacheLock);
+    return ((long long)(currentTerminal() & 0x3fff) << 48) | (((long long)time(NULL) & 0xffffffffLL) << 16) | sequence;
+}
+
+static RequestRecord *requestSlot(int cardId, long long requestId) {
+    uint64_t key = (uint64_t)requestId * 0x9E3779B97F4A7C15ULL ^ (uint32_t)cardId;
+    return &requestCache[(key ^ key >> 29) % DEDUPE_SLOTS];
+}
+
+static int lookupCachedRequest(int cardId, long long requestId, RequestRecord *record) {
+    int found = 0;
+    pthread_mutex_lock(&requestCacheLock);
+    RequestRecord *slot = requestSlot(cardId, requestId);
+    if (slot->requestId == requestId && slot->cardId == cardId) {
+        *record = *slot;
+        found = 1;
+    }
+    pthread_mutex_unlock(&requestCacheLock);
+    return found;
+}
+
+static void cacheRequest(const RequestRecord *record) {
+    pthread_mutex_lock(&requestCacheLock);
+    *requestSlot(record->cardId, record->requestId) = *record;
+    pthread_mutex_unlock(&requestCacheLock);
+}
+
+static int lookupStoredRequest(sqlite3 *db, int cardId, long long requestId, RequestRecord *record) {
+    sqlite3_stmt *stmt;
+    int found = 0;
+    const char *sql = "SELECT result, type, amount, oldBalance, newBalance FROM ATM_Requests "
+                      "WHERE cardId = ? AND requestId = ?";
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, cardId);
+        sqlite3_bind_int64(stmt, 2, requestId);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            record->requestId = requestId;
+            record->cardId = cardId;
+            record->result = sqlite3_column_int(stmt, 0);
+            snprintf(record->type, sizeof(record->type), "%s", (const char *)sqlite3_column_text(stmt, 1));
+            record->amount = sqlite3_column_double(stmt, 2);
+            record->oldBalance = sqlite3_column_double(stmt, 3);
+            record->newBalance = sqlite3_column_double(stmt, 4);
+            found = 1;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+// A retry has to describe the same operation as the request it repeats.
+static int sameRequest(const RequestRecord *record, const char *transactionType, double amount) {
+    return strcmp(record->type, transactionType) == 0 && fabs(record->amount - amount) < 0.005;
+}
+
+static void storeRequest(sqlite3 *db, const RequestRecord *record) {
+    sqlite3_stmt *stmt;
+    const char *sql = "INSERT INTO ATM_Requests "
+                      "(requestId, cardId, type, amount, result, oldBalance, newBalance, timestamp) "
+                      "VALUES (?, ?, ?, ?, ?, ?, ?, ?)";
+    sqlite3_int64 now = (sqlite3_int64)time(NULL);
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, record->requestId);
+        sqlite3_bind_int(stmt, 2, record->cardId);
+        sqlite3_bind_text(stmt, 3, record->type, -1, SQLITE_STATIC);
+        sqlite3_bind_double(stmt, 4, record->amount);
+        sqlite3_bind_int(stmt, 5, record->result);
+        sqlite3_bind_double(stmt, 6, record->oldBalance);
+        sqlite3_bind_double(stmt, 7, record->newBalance);
+        sqlite3_bind_int64(stmt, 8, now);
+        sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+}
+
+// Periodic maintenance, run by whichever process is up: the server from a thread
+// of its own, the scheduler every tick and the console between cards. Request
+// entries older than the dedupe window can no longer be retried, and change and
+// replica log entries past CHANGELOG_RETENTION are dropped (a standby further
+// behind reseeds itself). Trimming runs on a clock rather than on traffic, so an
+// idle system, or one doing only standing orders, accrual or PIN changes, trims
+// too. Runs as batch work so it never delays customers. Returns the number of rows
+// deleted, or -1 if the writer was not available.
+int runMaintenance(long long now) {
+    static const struct {
+        const char *sql;
+        long long retention;
+    } trims[] = {
+        {"DELETE FROM ATM_Requests WHERE timestamp < ?", DEDUPE_WINDOW},
+        {"DELETE FROM ATM_ChangeLog WHERE changedAt < ?", CHANGELOG_RETENTION},
+        {"DELETE FROM ATM_ReplicaLog WHERE changedAt < ?", CHANGELOG_RETENTION},
+    };
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int deleted = 0;
+
+    if ((db = dbWriterAcquirePriority(ADMIT_BATCH)) == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(trims) / sizeof(trims[0]); i++) {
+        if (sqlite3_prepare_v2(db, trims[i].sql, -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, now - trims[i].retention);
+            if (sqlite3_step(stmt) == SQLITE_DONE) {
+                deleted += sqlite3_changes(db);
+            }
+        }
+        sqlite3_finalize(stmt);
+    }
+    dbWriterRelease();
+    return deleted;
+}
+
+// Runs maintenance if MAINTENANCE_SECONDS have passed since it last ran in this process.
+void maintainIfDue() {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static long long lastRun;
+    long long now = (long long)time(NULL);
+
+    pthread_mutex_lock(&lock);
+    int due = now - lastRun >= MAINTENANCE_SECONDS;
+    if (due) {
+        lastRun = now;
+    }
+    pthread_mutex_unlock(&lock);
+    if (due) {
+        runMaintenance(now);
+    }
+}
+
+// Fraud velocity features. Each card keeps three rings of time buckets (10s x 6,
+// 5min x 12, 1h x 24) so the 1m/1h/24h windows are a sum over a handful of
+// buckets. Distinct terminals are tracked as a 64-bit mask per bucket. Cards are
+// chained off a fixed hash table; an entry is only freed once nothing has been
+// recorded for it in the last 24h, so unrelated traffic cannot erase a history.
+typedef struct {
+    uint32_t epoch;
+    uint32_t count;
+    double amount;
+    uint64_t terminals;
+} VelocityBucket;
+
+typedef struct CardVelocity {
+    struct CardVelocity *next;
+    int cardId;
+    uint32_t lastSeen;
+    VelocityBucket windows[FRAUD_WINDOWS][24];
+} CardVelocity;
+
+typedef struct {
+    int window;
+    int metric;
+    double threshold;
+    int action;
+} FraudRule;
+
+const int windowBucketSeconds[FRAUD_WINDOWS] = {10, 300, 3600};
+const int windowBucketCount[FRAUD_WINDOWS] = {6, 12, 24};
+const char *windowNames[FRAUD_WINDOWS] = {"1m", "1h", "24h"};
+const char *metricNames[] = {"count", "amount", "terminals"};
+const char *actionNames[] = {"allow", "decline", "block"};
+
+CardVelocity **velocityStore = NULL;
+pthread_mutex_t velocityLocks[64];
+pthread_once_t velocityOnce = PTHREAD_ONCE_INIT;
+
+FraudRule fraudRules[FRAUD_MAX_RULES] = {
+    {0, FRAUD_COUNT, 3, FRAUD_DECLINE},
+    {1, FRAUD_AMOUNT, 1000, FRAUD_DECLINE},
+    {2, FRAUD_AMOUNT, 2500, FRAUD_DECLINE},
+    {2, FRAUD_TERMINALS, 5, FRAUD_BLOCK},
+};
+int fraudRuleCount = 4;
+
+static void createVelocityStore() {
+    velocityStore = calloc(FRAUD_SLOTS, sizeof(CardVelocity *));
+    for (int i = 0; i < 64; i++) {
+        pthread_mutex_init(&velocityLocks[i], 0);
+    }
+}
+
+static int lookupIndex(const char *names[], int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Rules file format, one per line: <1m|1h|24h> <count|amount|terminals> <threshold> <decline|block>
+int loadFraudRules(const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[128], window[8], metric[16], action[16];
+    double threshold;
+    int count = 0;
+
+    if (file == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL && count < FRAUD_MAX_RULES) {
+        if (line[0] == '#' || sscanf(line, "%7s %15s %lf %15s", window, metric, &threshold, action) != 4) {
+            continue;
+        }
+        FraudRule rule = {lookupIndex(windowNames, FRAUD_WINDOWS, window), lookupIndex(metricNames, 3, metric),
+                          threshold, lookupIndex(actionNames, 3, action)};
+        if (rule.window < 0 || rule.metric < 0 || rule.action <= FRAUD_ALLOW) {
+            printf("Ignoring invalid fraud rule: %s", line);
+            continue;
+        }
+        fraudRules[count++] = rule;
+    }
+    fclose(file);
+    fraudRuleCount = count;
+    return count;
+}
+
+static CardVelocity **velocityChain(int cardId, pthread_mutex_t **lock) {
+    pthread_once(&velocityOnce, createVelocityStore);
+    if (velocityStore == NULL) {
+        return NULL;
+    }
+    unsigned int index = (unsigned int)cardId * 2654435761u % FRAUD_SLOTS;
+    *lock = &velocityLocks[index % 64];
+    return &velocityStore[index];
+}
+
+// Walks a chain under its lock. With reclaim set, entries idle for longer than the
+// widest window are unlinked on the way, since none of their buckets still count.
+static CardVelocity *findVelocity(CardVelocity **chain, int cardId, uint32_t now, int reclaim) {
+    uint32_t horizon = (uint32_t)(windowBucketSeconds[FRAUD_WINDOWS - 1] * windowBucketCount[FRAUD_WINDOWS - 1]);
+    CardVelocity *found = NULL;
+
+    while (*chain != NULL) {
+        CardVelocity *entry = *chain;
+        if (entry->cardId == cardId) {
+            found = entry;
+        } else if (reclaim && now - entry->lastSeen >= horizon) {
+            *chain = entry->next;
+            free(entry);
+            continue;
+        }
+        chain = &entry->next;
+    }
+    return found;
+}
+
+static uint64_t terminalBit(int terminal) {
+    return 1ULL << ((uint32_t)terminal * 2654435761u >> 26);
+}
+
+static void windowTotals(const CardVelocity *velocity, int window, uint32_t now, double totals[3]) {
+    uint32_t current = now / windowBucketSeconds[window];
+    uint64_t terminals = 0;
+
+    totals[FRAUD_COUNT] = totals[FRAUD_AMOUNT] = 0;
+    for (int i = 0; i < windowBucketCount[window]; i++) {
+        const VelocityBucket *bucket = &velocity->windows[window][i];
+        if (current - bucket->epoch < (uint32_t)windowBucketCount[window]) {
+            totals[FRAUD_COUNT] += bucket->count;
+            totals[FRAUD_AMOUNT] += bucket->amount;
+            terminals |= bucket->terminals;
+        }
+    }
+    totals[FRAUD_TERMINALS] = __builtin_popcountll(terminals);
+}
+
+int scoreWithdrawal(int cardId, double amount, int terminal) {
+    pthread_mutex_t *lock;
+    CardVelocity **chain = velocityChain(cardId, &lock);
+    uint32_t now = (uint32_t)time(NULL);
+    double totals[FRAUD_WINDOWS][3];
+    int action = FRAUD_ALLOW;
+
+    if (chain == NULL) {
+        return FRAUD_ALLOW;
+    }
+    pthread_mutex_lock(lock);
+    CardVelocity *velocity = findVelocity(chain, cardId, now, 0);
+    int known = velocity != NULL;
+    for (int w = 0; w < FRAUD_WINDOWS; w++) {
+        if (known) {
+            windowTotals(velocity, w, now, totals[w]);
+        } else {
+            totals[w][FRAUD_COUNT] = totals[w][FRAUD_AMOUNT] = totals[w][FRAUD_TERMINALS] = 0;
+        }
+    }
+    uint64_t recentTerminals = 0;
+    for (int i = 0; known && i < windowBucketCount[2]; i++) {
+        recentTerminals |= velocity->windows[2][i].terminals;
+    }
+    pthread_mutex_unlock(lock);
+
+    // Rules are judged as if this withdrawal had already gone through.
+    for (int w = 0; w < FRAUD_WINDOWS; w++) {
+        totals[w][FRAUD_COUNT] += 1;
+        totals[w][FRAUD_AMOUNT] += amount;
+        if (!(recentTerminals & terminalBit(terminal))) {
+            totals[w][FRAUD_TERMINALS] += 1;
+        }
+    }
+    for (int i = 0; i < fraudRuleCount; i++) {
+        const FraudRule *rule = &fraudRules[i];
+        if (totals[rule->window][rule->metric] > rule->threshold && rule->action > action) {
+            action = rule->action;
+        }
+    }
+    return action;
+}
+
+void recordWithdrawalFeatures(int cardId, double amount, int terminal) {
+    pthread_mutex_t *lock;
+    CardVelocity **chain = velocityChain(cardId, &lock);
+    uint32_t now = (uint32_t)time(NULL);
+
+    if (chain == NULL) {
+        return;
+    }
+    pthread_mutex_lock(lock);
+    CardVelocity *velocity = findVelocity(chain, cardId, now, 1);
+    if (velocity == NULL) {
+        if ((velocity = calloc(1, sizeof(CardVelocity))) == NULL) {
+            pthread_mutex_unlock(lock);
+            return;
+        }
+        velocity->cardId = cardId;
+        velocity->next = *chain;
+        *chain = velocity;
+    }
+    velocity->lastSeen = now;
+    for (int w = 0; w < FRAUD_WINDOWS; w++) {
+        uint32_t epoch = now / windowBucketSeconds[w];
+        VelocityBucket *bucket = &velocity->windows[w][epoch % windowBucketCount[w]];
+        if (bucket->epoch != epoch) {
+            memset(bucket, 0, sizeof(VelocityBucket));
+            bucket->epoch = epoch;
+        }
+        bucket->count++;
+        bucket->amount += amount;
+        bucket->terminals |= terminalBit(terminal);
+    }
+    pthread_mutex_unlock(lock);
+}
+
+int processCashRequest(Card *card, const char *transactionType, double amount, long long requestId, double *oldBalance) {
+    RequestRecord record;
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int replayed;
+
+    if (lookupCachedRequest(card->id, requestId, &record)) {
+        if (!sameRequest(&record, transactionType, amount)) {
+            return TX_INVALID;
+        }
+        *oldBalance = record.oldBalance;
+        card->balance = record.newBalance;
+        return record.result;
+    }
+
+    lockCards(card->id, card->id);
+    if ((db = dbWriterAcquire()) == NULL) {
+        unlockCards(card->id, card->id);
+        return TX_ERROR;
+    }
+    // IMMEDIATE still matters with one writer per process: other processes may share the file.
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK) {
+        dbWriterRelease();
+        unlockCards(card->id, card->id);
+        return TX_ERROR;
+    }
+
+    if (!(replayed = lookupStoredRequest(db, card->id, requestId, &record))) {
+        char sql[100];
+        int found = 0;
+
+        record.requestId = requestId;
+        record.cardId = card->id;
+        snprintf(record.type, sizeof(record.type), "%s", transactionType);
+        record.amount = amount;
+        sprintf(sql, "SELECT balance FROM ATM_Cards WHERE id = %d", card->id);
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+            record.oldBalance = sqlite3_column_double(stmt, 0);
+            found = 1;
+        }
+        sqlite3_finalize(stmt);
+        if (!found) {
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+            dbWriterRelease();
+            unlockCards(card->id, card->id);
+            return TX_ERROR;
+        }
+
+        record.newBalance = record.oldBalance + amount;
+        int fraudAction = amount < 0 ? scoreWithdrawal(card->id, -amount, currentTerminal()) : FRAUD_ALLOW;
+        if (fraudAction == FRAUD_BLOCK) {
+            record.result = TX_BLOCKED;
+            record.newBalance = record.oldBalance;
+            sprintf(sql, "UPDATE ATM_Cards SET blocked = 1 WHERE id = %d", card->id);
+            sqlite3_exec(db, sql, 0, 0, 0);
+        } else if (record.newBalance < 0 || fraudAction == FRAUD_DECLINE) {
+            record.result = TX_DECLINED;
+            record.newBalance = record.oldBalance;
+        } else {
+            record.result = TX_OK;
+            sprintf(sql, "UPDATE ATM_Cards SET balance = %.2f WHERE id = %d", record.newBalance, card->id);
+            sqlite3_exec(db, sql, 0, 0, 0);
+            insertTransaction(db, card->id, transactionType, amount, record.oldBalance, record.newBalance);
+        }
+        storeRequest(db, &record);
+    }
+
+    if (sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        dbWriterRelease();
+        unlockCards(card->id, card->id);
+        return TX_ERROR;
+    }
+    dbWriterRelease();
+    unlockCards(card->id, card->id);
+
+    if (replayed) {
+        if (!sameRequest(&record, transactionType, amount)) {
+            return TX_INVALID;
+        }
+        cacheRequest(&record);
+        *oldBalance = record.oldBalance;
+        card->balance = record.newBalance;
+        return record.result;
+    }
+    if (record.result == TX_OK && amount < 0) {
+        recordWithdrawalFeatures(card->id, -amount, currentTerminal());
+    }
+    if (record.result == TX_BLOCKED) {
+        card->blocked = 1;
+    }
+    auditEvent(card->id, amount < 0 ? AUDIT_WITHDRAW : AUDIT_DEPOSIT, fabs(amount), record.newBalance, record.result);
+    cacheRequest(&record);
+    *oldBalance = record.oldBalance;
+    card->balance = record.newBalance;
+    return record.result;
+}
+
+// Card locks. Operations lock the stripes of every card they touch, always in
+// ascending stripe order and before the writer, so two transfers between the same
+// cards in opposite directions can never wait on each other.
+pthread_mutex_t cardLocks[CARD_LOCK_STRIPES];
+pthread_once_t cardLocksOnce = PTHREAD_ONCE_INIT;
+
+static void createCardLocks() {
+    for (int i = 0; i < CARD_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&cardLocks[i], 0);
+    }
+}
+
+void lockCards(int firstId, int secondId) {
+    pthread_once(&cardLocksOnce, createCardLocks);
+    unsigned int a = (unsigned int)firstId % CARD_LOCK_STRIPES;
+    unsigned int b = (unsigned int)secondId % CARD_LOCK_STRIPES;
+
+    if (a > b) {
+        unsigned int swap = a;
+        a = b;
+        b = swap;
+    }
+    pthread_mutex_lock(&cardLocks[a]);
+    if (b != a) {
+        pthread_mutex_lock(&cardLocks[b]);
+    }
+}
+
+void unlockCards(int firstId, int secondId) {
+    unsigned int a = (unsigned int)firstId % CARD_LOCK_STRIPES;
+    unsigned int b = (unsigned int)secondId % CARD_LOCK_STRIPES;
+
+    if (b != a) {
+        pthread_mutex_unlock(&cardLocks[b]);
+    }
+    pthread_mutex_unlock(&cardLocks[a]);
+}
+
+static int readBalance(sqlite3 *db, int cardId, double *balance, int *blocked) {
+    sqlite3_stmt *stmt;
+    int found = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT balance, blocked FROM ATM_Cards WHERE id = ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, cardId);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            *balance = sqlite3_column_double(stmt, 0);
+            *blocked = sqlite3_column_int(stmt, 1);
+            found = 1;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+// Debits one card and credits another in a single writer transaction. Like cash
+// requests, transfers are deduplicated by request id; the stored outcome describes
+// the debited card.
+int transferFunds(Card *from, int toId, double amount, long long requestId, double *oldBalance) {
+    RequestRecord record;
+    sqlite3 *db;
+    int replayed;
+
+    if (lookupCachedRequest(from->id, requestId, &record)) {
+        if (!sameRequest(&record, "Transfer", -amount)) {
+            return TX_INVALID;
+        }
+        *oldBalance = record.oldBalance;
+        from->balance = record.newBalance;
+        return record.result;
+    }
+    if (amount <= 0 || toId == from->id) {
+        return TX_DECLINED;
+    }
+
+    lockCards(from->id, toId);
+    if ((db = dbWriterAcquire()) == NULL) {
+        unlockCards(from->id, toId);
+        return TX_ERROR;
+    }
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK) {
+        dbWriterRelease();
+        unlockCards(from->id, toId);
+        return TX_ERROR;
+    }
+
+    if (!(replayed = lookupStoredRequest(db, from->id, requestId, &record))) {
+        double toBalance;
+        int fromBlocked, toBlocked;
+
+        record.requestId = requestId;
+        record.cardId = from->id;
+        snprintf(record.type, sizeof(record.type), "Transfer");
+        record.amount = -amount;
+        if (!readBalance(db, from->id, &record.oldBalance, &fromBlocked) ||
+            !readBalance(db, toId, &toBalance, &toBlocked)) {
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+            dbWriterRelease();
+            unlockCards(from->id, toId);
+            return TX_ERROR;
+        }
+
+        record.newBalance = record.oldBalance;
+        // Money leaving by transfer counts against the same limits as cash.
+        int fraudAction = scoreWithdrawal(from->id, amount, currentTerminal());
+        if (fraudAction == FRAUD_BLOCK && !fromBlocked) {
+            sqlite3_stmt *block;
+            record.result = TX_BLOCKED;
+            sqlite3_prepare_v2(db, "UPDATE ATM_Cards SET blocked = 1 WHERE id = ?", -1, &block, 0);
+            sqlite3_bind_int(block, 1, from->id);
+            sqlite3_step(block);
+            sqlite3_finalize(block);
+        } else if (fromBlocked || toBlocked || record.oldBalance < amount || fraudAction == FRAUD_DECLINE) {
+            record.result = TX_DECLINED;
+        } else {
+            sqlite3_stmt *update;
+            int ids[2] = {from->id < toId ? from->id : toId, from->id < toId ? toId : from->id};
+
+            record.result = TX_OK;
+            record.newBalance = record.oldBalance - amount;
+            // Rows are written in id order, matching the lock order above.
+            sqlite3_prepare_v2(db, "UPDATE ATM_Cards SET balance = ? WHERE id = ?", -1, &update, 0);
+            for (int i = 0; i < 2; i++) {
+                sqlite3_bind_double(update, 1, ids[i] == from->id ? record.newBalance : toBalance + amount);
+                sqlite3_bind_int(update, 2, ids[i]);
+                sqlite3_step(update);
+                sqlite3_reset(update);
+            }
+            sqlite3_finalize(update);
+            insertTransaction(db, from->id, "Transfer Out", -amount, record.oldBalance, record.newBalance);
+            insertTransaction(db, toId, "Transfer In", amount, toBalance, toBalance + amount);
+        }
+        storeRequest(db, &record);
+    }
+
+    if (sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        dbWriterRelease();
+        unlockCards(from->id, toId);
+        return TX_ERROR;
+    }
+    dbWriterRelease();
+    unlockCards(from->id, toId);
+
+    if (replayed && !sameRequest(&record, "Transfer", -amount)) {
+        return TX_INVALID;
+    }
+    if (!replayed) {
+        if (record.result == TX_OK) {
+            recordWithdrawalFeatures(from->id, amount, currentTerminal());
+        }
+        auditEvent(from->id, AUDIT_TRANSFER, amount, record.newBalance, record.result);
+    }
+    if (record.result == TX_BLOCKED) {
+        from->blocked = 1;
+    }
+    cacheRequest(&record);
+    *oldBalance = record.oldBalance;
+    from->balance = record.newBalance;
+    return record.result;
+}
+
+int transferMoney(Card *card, int toId, double amount) {
+    Card recipient;
+    double oldBalance;
+
+    if (toId == card->id || fetchCard(toId, &recipient) == 0) {
+        printf("Invalid recipient card.\n");
+        return 0;
+    }
+    int result = amount > 0 ? transferFunds(card, toId, amount, newRequestId(), &oldBalance) : TX_DECLINED;
+    if (result == TX_OK) {
+        printf("Transfer to card %d successful. New balance: £%.2f\n", toId, card->balance);
+
+        if (wantsReceipt()) {
+            printReceipt(card, "Transfer", amount, oldBalance);
+        }
+        return 1;
+    } else if (result == TX_ERROR || result == TX_INVALID) {
+        printf("Transaction failed. Please try again.\n");
+        return 0;
+    } else if (result == TX_BLOCKED) {
+        printf("Card blocked due to unusual activity. Contact the bank.\n");
+        return 0;
+    } else {
+        printf("Transfer declined.\n");
+        return 0;
+    }
+}
+
+int withdrawMoney(Card *card, double amount) {
+    if ((int)amount % 5 != 0) {
+        printf("Error: Withdrawal amount must be divisible by 5, 10, or 20.\n");
+        return 0;
+    }
+
+    double oldBalance;
+    int result = amount > 0 ? processCashRequest(card, "Withdrawal", -amount, newRequestId(), &oldBalance) : TX_DECLINED;
+    if (result == TX_OK) {
+        printf("Withdrawal successful. New balance: £%.2f\n", card->balance);
+
+        if (wantsReceipt()) {
+            printReceipt(card, "Withdrawal", amount, oldBalance);
+        }
+        return 1;
+    } else if (result == TX_ERROR || result == TX_INVALID) {
+        printf("Transaction failed. Please try again.\n");
+        return 0;
+    } else if (result == TX_BLOCKED) {
+        printf("Card blocked due to unusual activity. Contact the bank.\n");
+        return 0;
+    } else if (amount > 0 && amount <= card->balance) {
+        printf("Withdrawal declined. Contact the bank if this persists.\n");
+        return 0;
+    } else {
+        printf("Insufficient funds.\n");
+        return 0;
+    }
+}
+
+int depositMoney(Card *card, double amount) {
+    double oldBalance;
+    int result = amount > 0 ? processCashRequest(card, "Deposit", amount, newRequestId(), &oldBalance) : TX_DECLINED;
+    if (result == TX_OK) {
+        printf("Deposit successful. New balance: £%.2f\n", card->balance);
+
+        if (wantsReceipt()) {
+            printReceipt(card, "Deposit", amount, oldBalance);
+        }
+        return 1;
+    } else if (result == TX_ERROR || result == TX_INVALID) {
+        printf("Transaction failed. Please try again.\n");
+        return 0;
+    } else {
+        printf("Invalid deposit amount.\n");
+        return 0;
+    }
+}
+
+void printReceipt(Card *card, const char *transactionType, double amount, double oldBalance) {
+    printf("\n--- Transaction Receipt ---\n");
+    printf("Card ID: %d\n", card->id);
+    printf("Owner: %s\n", card->ownerName);
+    printReceiptEntry(transactionType, amount, oldBalance, card->balance);
+    printf("---------------------------\n");
+}
+
+void printReceiptEntry(const char *transactionType, double amount, double oldBalance, double newBalance) {
+    printf("Transaction: %s\n", transactionType);
+    printf("Amount: £%.2f\n", amount);
+    printf("Old Balance: £%.2f\n", oldBalance);
+    printf("New Balance: £%.2f\n", newBalance);
+}
+
+// Keyset pagination: each page starts strictly after the last (timestamp, id) seen,
+// so the index seek costs the same on page 100 as on page 1. The same query runs
+// against the hot ledger ("main") or an attached month archive ("archive").
+static int fetchStatementRows(sqlite3 *db, const char *schema, int cardId, StatementCursor *cursor,
+                              Transaction *transactions, int max) {
+    sqlite3_stmt *stmt;
+    char sql[300];
+    int count = 0;
+
+    snprintf(sql, sizeof(sql),
+             "SELECT id, cardId, terminalId, type, amount, oldBalance, newBalance, timestamp "
+             "FROM %s.ATM_Transactions WHERE cardId = ?1%s "
+             "ORDER BY timestamp DESC, id DESC LIMIT ?2",
+             schema, cursor->id == 0 ? "" : " AND (timestamp, id) < (?3, ?4)");
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, cardId);
+        sqlite3_bind_int(stmt, 2, max);
+        if (cursor->id != 0) {
+            sqlite3_bind_int64(stmt, 3, cursor->timestamp);
+            sqlite3_bind_int(stmt, 4, cursor->id);
+        }
+        while (count < max && sqlite3_step(stmt) == SQLITE_ROW) {
+            Transaction *tx = &transactions[count++];
+            tx->id = sqlite3_column_int(stmt, 0);
+            tx->cardId = sqlite3_column_int(stmt, 1);
+            tx->terminalId = sqlite3_column_int(stmt, 2);
+            snprintf(tx->type, sizeof(tx->type), "%s", (const char *)sqlite3_column_text(stmt, 3));
+            tx->amount = sqlite3_column_double(stmt, 4);
+            tx->oldBalance = sqlite3_column_double(stmt, 5);
+            tx->newBalance = sqlite3_column_double(stmt, 6);
+            tx->timestamp = sqlite3_column_int64(stmt, 7);
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (count > 0) {
+        cursor->timestamp = transactions[count - 1].timestamp;
+        cursor->id = transactions[count - 1].id;
+    }
+    return count;
+}
+
+// Once the hot rows run out, archived months are attached one at a time, newest
+// first. Because the cursor only moves backwards, a row left in both files by an
+// interrupted archival run is never shown twice.
+int fetchMiniStatement(int cardId, StatementCursor *cursor, Transaction *transactions, int max) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int month = INT_MAX;
+
+    if ((db = dbReader()) == NULL) {
+        return 0;
+    }
+    int count = fetchStatementRows(db, "main", cardId, cursor, transactions, max);
+    while (count < max) {
+        char path[PATH_MAX] = "";
+        if (sqlite3_prepare_v2(db, "SELECT month, path FROM ATM_Archives WHERE month < ? AND firstTimestamp <= ? "
+                                   "ORDER BY month DESC LIMIT 1", -1, &stmt, 0) == SQLITE_OK) {
+            sqlite3_bind_int(stmt, 1, month);
+            sqlite3_bind_int64(stmt, 2, cursor->id == 0 ? LLONG_MAX : cursor->timestamp);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                month = sqlite3_column_int(stmt, 0);
+                snprintf(path, sizeof(path), "%s", (const char *)sqlite3_column_text(stmt, 1));
+            }
+        }
+        sqlite3_finalize(stmt);
+        if (path[0] == '\0') {
+            break;
+        }
+        if (attachDatabase(db, path, "archive", 0) != SQLITE_OK) {
+            continue; // A missing archive file hides only its own month
+        }
+        count += fetchStatementRows(db, "archive", cardId, cursor, transactions + count, max - count);
+        sqlite3_exec(db, "DETACH archive", 0, 0, 0);
+    }
+    return count;
+}
+
+void showMiniStatement(Card *card) {
+    Transaction transactions[MINI_STATEMENT_SIZE];
+    StatementCursor cursor = {0, 0};
+    char response = 'y';
+
+    printf("\n--- Mini Statement ---\n");
+    printf("Card ID: %d\n", card->id);
+    printf("Owner: %s\n", card->ownerName);
+
+    while (response == 'y' || response == 'Y') {
+        int count = fetchMiniStatement(card->id, &cursor, transactions, MINI_STATEMENT_SIZE);
+        if (count == 0) {
+            printf("No more transactions.\n");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            char date[20];
+            time_t when = (time_t)transactions[i].timestamp;
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&when));
+            printf("\nDate: %s\n", date);
+            printReceiptEntry(transactions[i].type, fabs(transactions[i].amount),
+                              transactions[i].oldBalance, transactions[i].newBalance);
+        }
+        if (count < MINI_STATEMENT_SIZE) {
+            break;
+        }
+        printf("Show more transactions? (y/n):\n> ");
+        if (scanf(" %c", &response) != 1) {
+            break;
+        }
+    }
+    printf("---------------------------\n");
+}
+
+int wantsReceipt() {
+    char response = 'n';
+    printf("Do you want to print a receipt? (y/n):\n> ");
+    scanf(" %c", &response);
+    return (response == 'y' || response == 'Y');
+}
+
+int isWeakPin(int pin) {
+    if (pin == 0) return 1; // запрещаем 0000
+
+    const int weakPins[] = {
+        1234, 4321, 9876, 5432, 6789, 8765, 1111,
+        2222, 3333, 4444, 5555, 6666, 7777, 8888, 9999
+    };
+    int i;
+    for (i = 0; i < sizeof(weakPins) / sizeof(weakPins[0]); i++) {
+        if (pin == weakPins[i]) {
+            return 1;
+        }
+    }
+
+    int firstDigit = pin / 1000;
+    if (pin == firstDigit * 1111) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int isValidPin(int pin) {
+    return pin >= 0 && pin <= 9999;
+}
+
+// Reconciliation walks the ledger in (cardId, id) order next to ATM_Cards in id
+// order, so each worker only ever holds the state of the card it is looking at.
+typedef struct {
+    pthread_mutex_t lock;
+    int nextChunk;
+    int chunks;
+    int minId;
+    ReconcileResult total;
+} ReconcileJob;
+
+static int amountsDiffer(double a, double b) {
+    return fabs(a - b) > 0.005;
+}
+
+static void reportDiscrepancy(ReconcileJob *job, int cardId, const char *reason, double expected, double actual) {
+    pthread_mutex_lock(&job->lock);
+    printf("Card %d: %s (expected £%.2f, found £%.2f)\n", cardId, reason, expected, actual);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Finds or adds the totals of a terminal, doubling the table at 3/4 load.
+// Returns NULL if the table cannot grow.
+static TerminalTotals *terminalTotals(ReconcileResult *result, long long terminalId) {
+    if ((result->terminalCount + 1) * 4 > result->terminalSlots * 3) {
+        size_t slots = result->terminalSlots == 0 ? 16 : result->terminalSlots * 2;
+        TerminalTotals *grown = calloc(slots, sizeof(TerminalTotals));
+        if (grown == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < result->terminalSlots; i++) {
+            TerminalTotals *old = &result->terminals[i];
+            if (old->count == 0) {
+                continue;
+            }
+            size_t slot = (size_t)((uint64_t)old->terminalId * 0x9E3779B97F4A7C15ULL >> 32) & (slots - 1);
+            while (grown[slot].count != 0) {
+                slot = (slot + 1) & (slots - 1);
+            }
+            grown[slot] = *old;
+        }
+        free(result->terminals);
+        result->terminals = grown;
+        result->terminalSlots = slots;
+    }
+
+    size_t slot = (size_t)((uint64_t)terminalId * 0x9E3779B97F4A7C15ULL >> 32) & (result->terminalSlots - 1);
+    while (result->terminals[slot].count != 0 && result->terminals[slot].terminalId != terminalId) {
+        slot = (slot + 1) & (result->terminalSlots - 1);
+    }
+    if (result->terminals[slot].count == 0) {
+        result->terminals[slot].terminalId = terminalId;
+        result->terminalCount++;
+    }
+    return &result->terminals[slot];
+}
+
+// Adds one terminal's totals into another result. Returns 0, or -1 out of memory.
+static int addTerminalTotals(ReconcileResult *result, const TerminalTotals *from) {
+    TerminalTotals *t = terminalTotals(result, from->terminalId);
+    if (t == NULL) {
+        return -1;
+    }
+    t->deposits += from->deposits;
+    t->withdrawals += from->withdrawals;
+    t->count += from->count;
+    return 0;
+}
+
+static int compareTerminals(const void *a, const void *b) {
+    long long left = ((const TerminalTotals *)a)->terminalId, right = ((const TerminalTotals *)b)->terminalId;
+    return (left > right) - (left < right);
+}
+
+static void reconcileChunk(sqlite3 *db, ReconcileJob *job, int firstId, int lastId, ReconcileResult *result) {
+    sqlite3_stmt *cards;
+    sqlite3_stmt *txs;
+    const char *cardSql = "SELECT id, balance FROM ATM_Cards WHERE id BETWEEN ? AND ? ORDER BY id";
+    const char *txSql = "SELECT cardId, terminalId, amount, oldBalance, newBalance FROM ATM_Transactions "
+                        "WHERE cardId BETWEEN ? AND ? ORDER BY cardId, id";
+
+    if (sqlite3_prepare_v2(db, cardSql, -1, &cards, 0) != SQLITE_OK) {
+        printf("SQL Error: %s\n", sqlite3_errmsg(db));
+        return;
+    }
+    if (sqlite3_prepare_v2(db, txSql, -1, &txs, 0) != SQLITE_OK) {
+        printf("SQL Error: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(cards);
+        return;
+    }
+    sqlite3_bind_int(cards, 1, firstId);
+    sqlite3_bind_int(cards, 2, lastId);
+    sqlite3_bind_int(txs, 1, firstId);
+    sqlite3_bind_int(txs, 2, lastId);
+
+    // Both cursors read from one snapshot so live sessions cannot produce false alarms.
+    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    int txRow = sqlite3_step(txs);
+    while (sqlite3_step(cards) == SQLITE_ROW) {
+        int cardId = sqlite3_column_int(cards, 0);
+        double balance = sqlite3_column_double(cards, 1);
+        int seen = 0;
+        double lastBalance = 0;
+
+        result->cards++;
+        for (; txRow == SQLITE_ROW && sqlite3_column_int(txs, 0) <= cardId; txRow = sqlite3_step(txs)) {
+            int txCard = sqlite3_column_int(txs, 0);
+            TerminalTotals tx = {sqlite3_column_int64(txs, 1), 0, 0, 1};
+            double amount = sqlite3_column_double(txs, 2);
+            double oldBalance = sqlite3_column_double(txs, 3);
+            double newBalance = sqlite3_column_double(txs, 4);
+
+            result->transactions++;
+            if (amount < 0) {
+                tx.withdrawals = -amount;
+            } else {
+                tx.deposits = amount;
+            }
+            if (addTerminalTotals(result, &tx) != 0) {
+                result->failed = 1;
+            }
+
+            if (txCard != cardId) {
+                reportDiscrepancy(job, txCard, "transaction for unknown card", 0, amount);
+                result->discrepancies++;
+                continue;
+            }
+            if (amountsDiffer(newBalance - oldBalance, amount)) {
+                reportDiscrepancy(job, cardId, "transaction amount does not match balance change",
+                                  amount, newBalance - oldBalance);
+                result->discrepancies++;
+            }
+            if (seen && amountsDiffer(oldBalance, lastBalance)) {
+                reportDiscrepancy(job, cardId, "gap in transaction history", lastBalance, oldBalance);
+                result->discrepancies++;
+            }
+            lastBalance = newBalance;
+            seen = 1;
+        }
+
+        if (seen && amountsDiffer(balance, lastBalance)) {
+            reportDiscrepancy(job, cardId, "balance does not match transaction history", lastBalance, balance);
+            result->discrepancies++;
+        }
+    }
+    for (; txRow == SQLITE_ROW; txRow = sqlite3_step(txs)) {
+        reportDiscrepancy(job, sqlite3_column_int(txs, 0), "transaction for unknown card", 0,
+                          sqlite3_column_double(txs, 2));
+        result->transactions++;
+        result->discrepancies++;
+    }
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+
+    sqlite3_finalize(cards);
+    sqlite3_finalize(txs);
+}
+
+static void *reconcileWorker(void *arg) {
+    ReconcileJob *job = arg;
+    ReconcileResult *result = calloc(1, sizeof(ReconcileResult));
+    sqlite3 *db;
+
+    if (result == NULL) {
+        return NULL;
+    }
+    if ((db = dbReader()) == NULL) {
+        printf("Error opening database.\n");
+        free(result);
+        return NULL;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int chunk = job->nextChunk++;
+        pthread_mutex_unlock(&job->lock);
+        if (chunk >= job->chunks) {
+            break;
+        }
+        int firstId = job->minId + chunk * RECONCILE_CHUNK;
+        reconcileChunk(db, job, firstId, firstId + RECONCILE_CHUNK - 1, result);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->total.cards += result->cards;
+    job->total.transactions += result->transactions;
+    job->total.discrepancies += result->discrepancies;
+    job->total.failed |= result->failed;
+    for (size_t i = 0; i < result->terminalSlots; i++) {
+        if (result->terminals[i].count != 0 && addTerminalTotals(&job->total, &result->terminals[i]) != 0) {
+            job->total.failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    free(result->terminals);
+    free(result);
+    return NULL;
+}
+
+int runReconciliation(int threads) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    int minId = 0, maxId = -1;
+
+    if ((db = dbReader()) == NULL) {
+        printf("Error opening database.\n");
+        return -1;
+    }
+    // Transactions can reference ids outside ATM_Cards, so the range covers both tables.
+    const char *sql = "SELECT MIN(lo), MAX(hi) FROM ("
+                      "SELECT MIN(id) AS lo, MAX(id) AS hi FROM ATM_Cards UNION ALL "
+                      "SELECT MIN(cardId), MAX(cardId) FROM ATM_Transactions)";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW &&
+        sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        minId = sqlite3_column_int(stmt, 0);
+        maxId = sqlite3_column_int(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+
+    ReconcileJob *job = calloc(1, sizeof(ReconcileJob));
+    if (job == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&job->lock, 0);
+    job->minId = minId;
+    job->chunks = maxId < minId ? 0 : (maxId - minId) / RECONCILE_CHUNK + 1;
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], 0, reconcileWorker, job);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], 0);
+    }
+    free(workers);
+
+    printf("\n--- Reconciliation Report ---\n");
+    printf("Cards checked: %ld\n", job->total.cards);
+    printf("Transactions checked: %ld\n", job->total.transactions);
+    printf("Discrepancies: %ld\n", job->total.discrepancies);
+    // The table is not needed as a table any more: pack it and list terminals in id order.
+    size_t terminals = 0;
+    for (size_t i = 0; i < job->total.terminalSlots; i++) {
+        if (job->total.terminals[i].count != 0) {
+            job->total.terminals[terminals++] = job->total.terminals[i];
+        }
+    }
+    if (terminals > 0) {
+        qsort(job->total.terminals, terminals, sizeof(TerminalTotals), compareTerminals);
+    }
+    for (size_t i = 0; i < terminals; i++) {
+        TerminalTotals *t = &job->total.terminals[i];
+        printf("Terminal %lld: %ld transactions, deposits £%.2f, withdrawals £%.2f\n", t->terminalId, t->count,
+               t->deposits, t->withdrawals);
+    }
+    if (job->total.failed) {
+        printf("Error: out of memory; terminal totals are incomplete.\n");
+    }
+    printf("-----------------------------\n");
+
+    int discrepancies = job->total.failed ? -1 : (int)job->total.discrepancies;
+    pthread_mutex_destroy(&job->lock);
+    free(job->total.terminals);
+    free(job);
+    return discrepancies;
+}
+
+// Terminal protocol. Every frame is a big-endian u32 length followed by that many
+// bytes. Requests carry op, terminal id (u16 after the op byte, 0 if the terminal
+// does not send one), card id and client request id in a fixed header and an
+// op-specific payload; responses echo op and request id with a status and balance.
+// Requests are decoded straight out of the receive buffer into a RequestView that
+// points back into it, so nothing is copied or allocated per field.
+static uint16_t readU16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t readU32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t readU64(const uint8_t *p) {
+    return (uint64_t)readU32(p) << 32 | readU32(p + 4);
+}
+
+static void writeU32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void writeU64(uint8_t *p, uint64_t v) {
+    writeU32(p, (uint32_t)(v >> 32));
+    writeU32(p + 4, (uint32_t)v);
+}
+
+int parseRequest(const uint8_t *buffer, size_t length, RequestView *request) {
+    if (length < 4) {
+        return 0;
+    }
+    uint32_t frameLength = readU32(buffer);
+    if (frameLength < PROTO_HEADER_SIZE || frameLength > PROTO_MAX_FRAME) {
+        return -1;
+    }
+    if (length < 4 + frameLength) {
+        return 0;
+    }
+
+    const uint8_t *frame = buffer + 4;
+    uint32_t payloadLength = frameLength - PROTO_HEADER_SIZE;
+    request->op = frame[0];
+    request->terminalId = readU16(frame + 2);
+    request->cardId = readU32(frame + 4);
+    request->requestId = readU64(frame + 8);
+    request->payload = frame + PROTO_HEADER_SIZE;
+    request->payloadLength = payloadLength;
+
+    switch (request->op) {
+        case OP_AUTH:
+        case OP_PIN_CHANGE:
+            if (payloadLength != 2) return -1;
+            request->pin = readU16(request->payload);
+            break;
+        case OP_WITHDRAW:
+        case OP_DEPOSIT:
+            if (payloadLength != 8) return -1;
+            request->amountPence = (int64_t)readU64(request->payload);
+            break;
+        case OP_TRANSFER:
+            if (payloadLength != 12) return -1;
+            request->toCardId = readU32(request->payload);
+            request->amountPence = (int64_t)readU64(request->payload + 4);
+            break;
+        case OP_BALANCE:
+        case OP_EJECT:
+            if (payloadLength != 0) return -1;
+            break;
+        default:
+            return -1;
+    }
+    return (int)(4 + frameLength);
+}
+
+size_t encodeResponse(uint8_t *buffer, const RequestView *request, int status, double balance) {
+    writeU32(buffer, PROTO_RESPONSE_SIZE);
+    buffer[4] = request->op;
+    buffer[5] = (uint8_t)status;
+    buffer[6] = 0;
+    buffer[7] = 0;
+    writeU64(buffer + 8, request->requestId);
+    writeU64(buffer + 16, (uint64_t)llround(balance * 100));
+    return 4 + PROTO_RESPONSE_SIZE;
+}
+
+static int transactionStatus(int result) {
+    switch (result) {
+        case TX_OK:
+            return STATUS_OK;
+        case TX_DECLINED:
+            return STATUS_DECLINED;
+        case TX_INVALID:
+            return STATUS_INVALID;
+        default:
+            return STATUS_ERROR;
+    }
+}
+
+// Session state machine. A terminal starts in CARD_ENTRY; an auth frame loads the
+// card and moves it to PIN_ENTRY, where wrong PINs count towards the card's
+// PIN_MAX_ATTEMPTS limit (shared with every other terminal) before it is blocked. A correct PIN opens MENU until the card is ejected. Nothing
+// here blocks on the customer, so one reactor thread can hold any number of
+// sessions that are sitting idle. With deferPins set, a step that needs the slow
+// PIN hash returns STATUS_PENDING and is finished when the request comes back with
+// pinResult filled in.
+int sessionHandleRequest(TerminalSession *session, const RequestView *request) {
+    double oldBalance;
+    int result, verified;
+
+    switch (session->state) {
+        case SESSION_CARD_ENTRY:
+            if (request->op != OP_AUTH) {
+                return STATUS_NOT_AUTHENTICATED;
+            }
+            if (fetchCard((int)request->cardId, &session->card) == 0) {
+                return STATUS_INVALID;
+            }
+            if (request->terminalId != 0) {
+                session->terminalId = request->terminalId;
+            }
+            if (session->card.blocked) {
+                return STATUS_BLOCKED;
+            }
+            session->state = SESSION_PIN_ENTRY;
+            return sessionHandleRequest(session, request);
+
+        case SESSION_PIN_ENTRY:
+            if (request->op == OP_EJECT) {
+                session->state = SESSION_CARD_ENTRY;
+                return STATUS_OK;
+            }
+            if (request->op != OP_AUTH || request->cardId != (uint32_t)session->card.id) {
+                return STATUS_NOT_AUTHENTICATED;
+            }
+            if (session->pinResult != PIN_RESULT_NONE) {
+                verified = session->pinResult == PIN_RESULT_OK;
+                session->pinResult = PIN_RESULT_NONE;
+            } else if (session->deferPins && !pinCacheLookup(&session->pins, session->card.id, session->card.pinHash, request->pin)) {
+                return STATUS_PENDING;
+            } else {
+                verified = checkPin(&session->pins, &session->card, request->pin);
+            }
+            if (verified) {
+                verified = acceptPin(&session->card);
+                if (verified < 0) {
+                    return STATUS_ERROR;
+                }
+                auditEvent(session->card.id, AUDIT_AUTH, 0, session->card.balance, verified);
+                if (session->card.blocked) {
+                    session->state = SESSION_CARD_ENTRY;
+                    return STATUS_BLOCKED;
+                }
+                if (!verified) {
+                    return STATUS_BAD_PIN; // The PIN was changed meanwhile
+                }
+                session->state = SESSION_MENU;
+                return STATUS_OK;
+            }
+            auditEvent(session->card.id, AUDIT_AUTH, 0, session->card.balance, 0);
+            if (recordFailedPin(&session->card) < 0) {
+                return STATUS_ERROR;
+            }
+            if (session->card.blocked) {
+                session->state = SESSION_CARD_ENTRY;
+                return STATUS_BLOCKED;
+            }
+            return STATUS_BAD_PIN;
+
+        case SESSION_MENU:
+            if (request->cardId != (uint32_t)session->card.id) {
+                return STATUS_NOT_AUTHENTICATED;
+            }
+            switch (request->op) {
+                case OP_BALANCE:
+                    // Other terminals, incoming transfers and standing orders move the
+                    // balance while the session is open, so answer from the database.
+                    if (fetchCard(session->card.id, &session->card) == 0) {
+                        return STATUS_ERROR;
+                    }
+                    if (session->card.blocked) {
+                        session->state = SESSION_CARD_ENTRY;
+                        return STATUS_BLOCKED;
+                    }
+                    return STATUS_OK;
+                case OP_WITHDRAW:
+                    if (request->amountPence <= 0 || request->amountPence % 500 != 0) {
+                        return STATUS_INVALID;
+                    }
+                    result = processCashRequest(&session->card, "Withdrawal", -request->amountPence / 100.0,
+                                                (long long)request->requestId, &oldBalance);
+                    if (result == TX_BLOCKED) {
+                        session->state = SESSION_CARD_ENTRY;
+                        return STATUS_BLOCKED;
+                    }
+                    return transactionStatus(result);
+                case OP_DEPOSIT:
+                    if (request->amountPence <= 0) {
+                        return STATUS_INVALID;
+                    }
+                    result = processCashRequest(&session->card, "Deposit", request->amountPence / 100.0,
+                                                (long long)request->requestId, &oldBalance);
+                    return transactionStatus(result);
+                case OP_TRANSFER:
+                    if (request->amountPence <= 0) {
+                        return STATUS_INVALID;
+                    }
+                    result = transferFunds(&session->card, (int)request->toCardId, request->amountPence / 100.0,
+                                           (long long)request->requestId, &oldBalance);
+                    if (result == TX_BLOCKED) {
+                        session->state = SESSION_CARD_ENTRY;
+                        return STATUS_BLOCKED;
+                    }
+                    return transactionStatus(result);
+                case OP_PIN_CHANGE:
+                    if (!isValidPin(request->pin) || isWeakPin(request->pin)) {
+                        return STATUS_INVALID;
+                    }
+                    if (session->pinResult != PIN_RESULT_NONE) {
+                        result = session->pinResult == PIN_RESULT_OK;
+                        session->pinResult = PIN_RESULT_NONE;
+                    } else if (session->deferPins) {
+                        return STATUS_PENDING;
+                    } else {
+                        result = storePin(session->card.id, request->pin, session->card.pinHash);
+                    }
+                    return result ? STATUS_OK : STATUS_ERROR;
+                case OP_EJECT:
+                    session->state = SESSION_CARD_ENTRY;
+                    return STATUS_OK;
+            }
+            return STATUS_INVALID;
+    }
+    return STATUS_ERROR;
+}
+
+static void closeConnection(int epollFd, TerminalConnection *connection) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, 0);
+    close(connection->fd);
+    free(connection);
+}
+
+// Sends whatever is queued; returns 0 once the queue is empty, 1 if the socket
+// is full and the rest must wait for EPOLLOUT, -1 if the peer has gone.
+static int flushConnection(TerminalConnection *connection) {
+    while (connection->outputSent < connection->outputUsed) {
+        ssize_t sent = write(connection->fd, connection->output + connection->outputSent,
+                             connection->outputUsed - connection->outputSent);
+        if (sent < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        connection->outputSent += (size_t)sent;
+    }
+    connection->outputSent = connection->outputUsed = 0;
+    return 0;
+}
+
+// PIN workers. Checking or changing a PIN costs a full PBKDF2 run, so reactors never
+// do it themselves: the connection is parked with the request still at the front of
+// its input and taken out of the reactor's epoll set, a worker runs the step against
+// the session, and the connection goes back on its reactor's completion list, which
+// wakes the reactor through an eventfd to replay the request with the outcome.
+static pthread_mutex_t pinJobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pinJobReady = PTHREAD_COND_INITIALIZER;
+static TerminalConnection *pinJobHead = NULL;
+static TerminalConnection *pinJobTail = NULL;
+
+static void *pinWorker(void *arg) {
+    (void)arg;
+    while (1) {
+        TerminalConnection *connection;
+        RequestView request;
+        int ok = 0;
+
+        pthread_mutex_lock(&pinJobLock);
+        while (pinJobHead == NULL) {
+            pthread_cond_wait(&pinJobReady, &pinJobLock);
+        }
+        connection = pinJobHead;
+        pinJobHead = connection->pinNext;
+        if (pinJobHead == NULL) {
+            pinJobTail = NULL;
+        }
+        pthread_mutex_unlock(&pinJobLock);
+
+        TerminalSession *session = &connection->session;
+        if (parseRequest(connection->input, connection->inputUsed, &request) > 0) {
+            sessionTerminal = session->terminalId;
+            if (session->state == SESSION_PIN_ENTRY) {
+                ok = checkPin(&session->pins, &session->card, request.pin);
+            } else {
+                ok = storePin(session->card.id, request.pin, session->card.pinHash);
+            }
+            sessionTerminal = 0;
+        }
+        session->pinResult = ok ? PIN_RESULT_OK : PIN_RESULT_FAILED;
+
+        PinCompletions *completions = connection->pinCompletions;
+        uint64_t one = 1;
+        pthread_mutex_lock(&completions->lock);
+        connection->pinNext = completions->done;
+        completions->done = connection;
+        pthread_mutex_unlock(&completions->lock);
+        // A failed write means the counter is already non-zero, so the reactor wakes anyway.
+        ssize_t woken = write(completions->eventFd, &one, sizeof(one));
+        (void)woken;
+    }
+    return NULL;
+}
+
+static void submitPinJob(TerminalConnection *connection) {
+    pthread_mutex_lock(&pinJobLock);
+    connection->pinNext = NULL;
+    if (pinJobTail != NULL) {
+        pinJobTail->pinNext = connection;
+    } else {
+        pinJobHead = connection;
+    }
+    pinJobTail = connection;
+    pthread_cond_signal(&pinJobReady);
+    pthread_mutex_unlock(&pinJobLock);
+}
+
+// Answers every complete request in the input. Returns 1 if the connection was
+// parked on a PIN worker (the pending request stays at the front of the input),
+// -1 on a malformed frame and 0 otherwise.
+static int processInput(TerminalConnection *connection) {
+    size_t offset = 0;
+    RequestView request;
+    int consumed, parked = 0;
+
+    while ((consumed = parseRequest(connection->input + offset, connection->inputUsed - offset, &request)) > 0) {
+        sessionTerminal = connection->session.terminalId;
+        int status = sessionHandleRequest(&connection->session, &request);
+        sessionTerminal = 0;
+        if (status == STATUS_PENDING) {
+            parked = 1;
+            break;
+        }
+        connection->outputUsed += encodeResponse(connection->output + connection->outputUsed, &request, status,
+                                                 connection->session.card.balance);
+        offset += (size_t)consumed;
+    }
+    if (consumed < 0 && !parked) {
+        return -1;
+    }
+    memmove(connection->input, connection->input + offset, connection->inputUsed - offset);
+    connection->inputUsed -= offset;
+    if (parked) {
+        submitPinJob(connection);
+    }
+    return parked;
+}
+
+// Returns 1 if the connection was parked on a PIN worker, -1 if it should be closed.
+static int readConnection(TerminalConnection *connection) {
+    while (1) {
+        if (connection->outputUsed > 0) {
+            return 0; // Stop reading until the client drains its responses.
+        }
+        ssize_t received = read(connection->fd, connection->input + connection->inputUsed,
+                                sizeof(connection->input) - connection->inputUsed);
+        if (received == 0) {
+            return -1;
+        }
+        if (received < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        connection->inputUsed += (size_t)received;
+
+        int processed = processInput(connection);
+        if (processed < 0) {
+            return -1;
+        }
+        if (processed > 0) {
+            // Workers never touch the output, so earlier answers go out now; a
+            // failed send shows up again once the connection is handed back.
+            flushConnection(connection);
+            return 1;
+        }
+        if (flushConnection(connection) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Puts a connection back under epoll, waiting for output space if responses are
+// still queued and for input otherwise.
+static void watchConnection(int epollFd, TerminalConnection *connection, int op) {
+    struct epoll_event event;
+    event.events = connection->outputUsed > 0 ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(epollFd, op, connection->fd, &event);
+}
+
+static void *terminalReactor(void *arg) {
+    int listener = (int)(intptr_t)arg;
+    struct epoll_event events[REACTOR_EVENTS];
+    struct epoll_event event;
+    int epollFd = epoll_create1(0);
+    PinCompletions completions = {PTHREAD_MUTEX_INITIALIZER, NULL, eventfd(0, EFD_NONBLOCK)};
+
+    if (epollFd < 0 || completions.eventFd < 0) {
+        return NULL;
+    }
+    // The listener is shared by every reactor; EPOLLEXCLUSIVE wakes only one of them.
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listener, &event);
+    event.events = EPOLLIN;
+    event.data.ptr = &completions;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, completions.eventFd, &event);
+
+    while (1) {
+        int ready = epoll_wait(epollFd, events, REACTOR_EVENTS, -1);
+        for (int i = 0; i < ready; i++) {
+            TerminalConnection *connection = events[i].data.ptr;
+
+            if (connection == NULL) {
+                int fd;
+                while ((fd = accept(listener, 0, 0)) >= 0) {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    connection = calloc(1, sizeof(TerminalConnection));
+                    if (connection == NULL) {
+                        close(fd);
+                        continue;
+                    }
+                    connection->fd = fd;
+                    connection->session.state = SESSION_CARD_ENTRY;
+                    connection->session.terminalId = __atomic_add_fetch(&nextConnectionTerminal, 1, __ATOMIC_RELAXED);
+                    connection->session.deferPins = 1;
+                    connection->pinCompletions = &completions;
+                    watchConnection(epollFd, connection, EPOLL_CTL_ADD);
+                }
+                continue;
+            }
+
+            if (events[i].data.ptr == &completions) {
+                uint64_t count;
+                TerminalConnection *done;
+                if (read(completions.eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    continue;
+                }
+                pthread_mutex_lock(&completions.lock);
+                done = completions.done;
+                completions.done = NULL;
+                pthread_mutex_unlock(&completions.lock);
+                while (done != NULL) {
+                    connection = done;
+                    done = done->pinNext;
+                    int processed = processInput(connection);
+                    if (processed < 0 || (processed == 0 && flushConnection(connection) < 0)) {
+                        close(connection->fd);
+                        free(connection);
+                    } else if (processed == 0) {
+                        watchConnection(epollFd, connection, EPOLL_CTL_ADD);
+                    }
+                }
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                closeConnection(epollFd, connection);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                int flushed = flushConnection(connection);
+                if (flushed < 0) {
+                    closeConnection(epollFd, connection);
+                    continue;
+                }
+                if (flushed > 0) {
+                    continue;
+                }
+            }
+            int status = readConnection(connection);
+            if (status < 0) {
+                closeConnection(epollFd, connection);
+                continue;
+            }
+            if (status > 0) {
+                // Parked: a worker owns the session until it hands the connection back.
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, 0);
+                continue;
+            }
+            watchConnection(epollFd, connection, EPOLL_CTL_MOD);
+        }
+    }
+}
+
+static void *maintenanceRunner(void *arg) {
+    (void)arg;
+    while (1) {
+        maintainIfDue();
+        sleep(MAINTENANCE_SECONDS);
+    }
+    return NULL;
+}
+
+static void *admissionReporter(void *arg) {
+    long last = -1;
+
+    (void)arg;
+    while (1) {
+        AdmissionStats stats;
+        sleep(ADMISSION_REPORT_SECONDS);
+        admissionSnapshot(&stats);
+        long total = stats.admitted[ADMIT_CUSTOMER] + stats.shed[ADMIT_CUSTOMER] + stats.admitted[ADMIT_BATCH];
+        if (total != last) {
+            printAdmissionStats();
+            fflush(stdout);
+            last = total;
+        }
+    }
+    return NULL;
+}
+
+int runTerminalServer(const char *socketPath, int threads) {
+    struct sockaddr_un address;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (listener < 0) {
+        printf("Error creating socket.\n");
+        return 1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socketPath);
+    unlink(socketPath);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        printf("Error listening on %s.\n", socketPath);
+        close(listener);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int pinWorkers = cpus < 1 ? 1 : cpus > PIN_WORKERS_MAX ? PIN_WORKERS_MAX : (int)cpus;
+    printf("Terminal server listening on %s with %d reactor thread(s) and %d PIN worker(s)\n", socketPath, threads, pinWorkers);
+    fflush(stdout);
+
+    pthread_t *reactors = malloc(sizeof(pthread_t) * threads);
+    pthread_t reporter, maintainer, worker;
+    for (int i = 0; i < pinWorkers; i++) {
+        pthread_create(&worker, 0, pinWorker, NULL);
+    }
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&reactors[i], 0, terminalReactor, (void *)(intptr_t)listener);
+    }
+    pthread_create(&reporter, 0, admissionReporter, NULL);
+    pthread_create(&maintainer, 0, maintenanceRunner, NULL);
+    terminalReactor((void *)(intptr_t)listener);
+    free(reactors);
+    return 1;
+}
+
+static size_t encodeRequest(uint8_t *buffer, uint8_t op, uint32_t cardId, uint64_t requestId, int64_t value) {
+    uint32_t payloadLength = op == OP_AUTH || op == OP_PIN_CHANGE ? 2 : op == OP_WITHDRAW || op == OP_DEPOSIT ? 8 : 0;
+    uint8_t *frame = buffer + 4;
+
+    writeU32(buffer, PROTO_HEADER_SIZE + payloadLength);
+    memset(frame, 0, PROTO_HEADER_SIZE);
+    frame[0] = op;
+    writeU32(frame + 4, cardId);
+    writeU64(frame + 8, requestId);
+    if (payloadLength == 2) {
+        frame[PROTO_HEADER_SIZE] = (uint8_t)(value >> 8);
+        frame[PROTO_HEADER_SIZE + 1] = (uint8_t)value;
+    } else if (payloadLength == 8) {
+        writeU64(frame + PROTO_HEADER_SIZE, (uint64_t)value);
+    }
+    return 4 + PROTO_HEADER_SIZE + payloadLength;
+}
+
+// Scripted session workload used for PGO training and for comparing builds: every
+// session authenticates (one wrong PIN first on every tenth), checks the balance,
+// withdraws, deposits and ejects, all through the same parse/state machine path
+// the terminal server uses.
+int runBenchmark(int sessions) {
+    uint8_t input[PROTO_BUFFER_SIZE];
+    uint8_t output[4 + PROTO_RESPONSE_SIZE];
+    TerminalSession session;
+    struct timespec start, end;
+    long requests = 0;
+    uint64_t requestId = (uint64_t)newRequestId();
+    char pinHash[PIN_HASH_SIZE];
+
+    // The synthetic cards share one salt so setup does not pay for BENCH_CARDS hashes,
+    // and use BENCH_PIN_ITERATIONS rounds: with one session cycling through far more
+    // cards than its PIN cache holds, every login misses, and at full cost the run
+    // (and any PGO training on it) would measure PBKDF2 rather than the request path.
+    if (!hashPin(BENCH_PIN, BENCH_PIN_ITERATIONS, pinHash)) {
+        return 1;
+    }
+    sqlite3 *db = dbWriterAcquire();
+    if (db == NULL) {
+        return 1;
+    }
+    sqlite3_exec(db, "BEGIN", 0, 0, 0);
+    for (int i = 0; i < BENCH_CARDS; i++) {
+        char sql[512];
+        sprintf(sql, "INSERT INTO ATM_Cards (id, pinHash, balance, blocked, ownerName) VALUES (%d, '%s', 1000000.0, 0, 'Bench User %d') "
+                     "ON CONFLICT (id) DO UPDATE SET pinHash = excluded.pinHash, balance = excluded.balance, blocked = 0, failedAttempts = 0",
+                BENCH_FIRST_CARD + i, pinHash, i);
+        sqlite3_exec(db, sql, 0, 0, 0);
+    }
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    dbWriterRelease();
+
+    memset(&session, 0, sizeof(session));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < sessions; i++) {
+        uint32_t cardId = BENCH_FIRST_CARD + i % BENCH_CARDS;
+        size_t used = 0;
+
+        if (i % 10 == 0) {
+            used += encodeRequest(input + used, OP_AUTH, cardId, requestId++, BENCH_PIN + 1);
+        }
+        used += encodeRequest(input + used, OP_AUTH, cardId, requestId++, BENCH_PIN);
+        used += encodeRequest(input + used, OP_BALANCE, cardId, requestId++, 0);
+        used += encodeRequest(input + used, OP_WITHDRAW, cardId, requestId++, 2000);
+        used += encodeRequest(input + used, OP_DEPOSIT, cardId, requestId++, 2000);
+        used += encodeRequest(input + used, OP_EJECT, cardId, requestId++, 0);
+
+        size_t offset = 0;
+        RequestView request;
+        int consumed;
+        while ((consumed = parseRequest(input + offset, used - offset, &request)) > 0) {
+            int status = sessionHandleRequest(&session, &request);
+            encodeResponse(output, &request, status, session.card.balance);
+            offset += (size_t)consumed;
+            requests++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Benchmark: %d sessions, %ld requests in %.3fs (%.0f requests/s)\n",
+           sessions, requests, seconds, requests / seconds);
+    printf("PIN cache: %ld hit(s), %ld miss(es)\n", session.pins.hits, session.pins.misses);
+    printAdmissionStats();
+    return 0;
+}
+
+// Hot standby. Triggers on every state table (replicatedTables) append the key of
+// each changed row to ATM_ReplicaLog in the same transaction, so a standby only has
+// to tail the log by sequence number and, for each key, copy the row as it stands
+// on the primary now, or delete it if it is gone. The primary is attached to the
+// standby connection and each batch runs in one transaction over both, so rows come
+// from a single commit point. A new standby, or one that fell behind the log's
+// retention, is seeded by reconciling every replicated table in full. Progress is
+// kept in the standby's ATM_Meta table, so a restarted standby resumes where it
+// stopped.
+typedef struct {
+    const char *name;
+    sqlite3_stmt *remove;
+    sqlite3_stmt *upsert;
+    sqlite3_stmt *seedRemove;
+    sqlite3_stmt *seedCopy;
+} ReplicaTable;
+
+static long long readMeta(sqlite3 *db, const char *key) {
+    sqlite3_stmt *stmt;
+    long long value = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT value FROM ATM_Meta WHERE key = ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            value = sqlite3_column_int64(stmt, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static int writeMeta(sqlite3 *db, const char *key, long long value) {
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO ATM_Meta (key, value) VALUES (?, ?)", -1, &stmt, 0);
+
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, value);
+        rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static int stepDone(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void finalizeReplicaTables(ReplicaTable *tables, int count) {
+    for (int i = 0; i < count; i++) {
+        sqlite3_finalize(tables[i].remove);
+        sqlite3_finalize(tables[i].upsert);
+        sqlite3_finalize(tables[i].seedRemove);
+        sqlite3_finalize(tables[i].seedCopy);
+    }
+}
+
+// Builds the statements that move one table's rows from source into main. Rows are
+// matched on the primary key; ?1 is the JSON key array written by the triggers.
+static int prepareReplicaTable(sqlite3 *standby, const char *name, ReplicaTable *table) {
+    sqlite3_stmt *info;
+    sqlite3_str *columns = sqlite3_str_new(standby);
+    sqlite3_str *keys = sqlite3_str_new(standby);
+    sqlite3_str *keyValues = sqlite3_str_new(standby);
+    sqlite3_str *updates = sqlite3_str_new(standby);
+    int keyCount = 0, rc;
+
+    memset(table, 0, sizeof(*table));
+    table->name = name;
+    rc = sqlite3_prepare_v2(standby, "SELECT name, pk FROM pragma_table_info(?, 'main') ORDER BY pk, cid", -1, &info, 0);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(info, 1, name, -1, SQLITE_STATIC);
+        while ((rc = sqlite3_step(info)) == SQLITE_ROW) {
+            const char *column = (const char *)sqlite3_column_text(info, 0);
+            sqlite3_str_appendf(columns, "%s\"%w\"", sqlite3_str_length(columns) ? ", " : "", column);
+            if (sqlite3_column_int(info, 1) > 0) {
+                sqlite3_str_appendf(keys, "%s\"%w\"", keyCount ? ", " : "", column);
+                sqlite3_str_appendf(keyValues, "%sjson_extract(?1, '$[%d]')", keyCount ? ", " : "", keyCount);
+                keyCount++;
+            } else {
+                sqlite3_str_appendf(updates, "%s\"%w\" = excluded.\"%w\"", sqlite3_str_length(updates) ? ", " : "",
+                                    column, column);
+            }
+        }
+        rc = rc == SQLITE_DONE && keyCount > 0 ? SQLITE_OK : SQLITE_ERROR;
+    }
+    sqlite3_finalize(info);
+
+    char *columnList = sqlite3_str_finish(columns);
+    char *keyList = sqlite3_str_finish(keys);
+    char *keyMatch = sqlite3_str_finish(keyValues);
+    char *updateList = sqlite3_str_finish(updates);
+    char *conflict = updateList != NULL ? sqlite3_mprintf("DO UPDATE SET %s", updateList) : sqlite3_mprintf("DO NOTHING");
+    char *sql[4] = {
+        sqlite3_mprintf("DELETE FROM main.\"%w\" WHERE (%s) = (%s) AND NOT EXISTS "
+                        "(SELECT 1 FROM source.\"%w\" WHERE (%s) = (%s))",
+                        name, keyList, keyMatch, name, keyList, keyMatch),
+        sqlite3_mprintf("INSERT INTO main.\"%w\" (%s) SELECT %s FROM source.\"%w\" WHERE (%s) = (%s) ON CONFLICT %s",
+                        name, columnList, columnList, name, keyList, keyMatch, conflict),
+        sqlite3_mprintf("DELETE FROM main.\"%w\" WHERE (%s) NOT IN (SELECT %s FROM source.\"%w\")",
+                        name, keyList, keyList, name),
+        sqlite3_mprintf("INSERT INTO main.\"%w\" (%s) SELECT %s FROM source.\"%w\" WHERE true ON CONFLICT %s",
+                        name, columnList, columnList, name, conflict),
+    };
+    sqlite3_stmt **targets[4] = {&table->remove, &table->upsert, &table->seedRemove, &table->seedCopy};
+    for (int i = 0; i < 4; i++) {
+        if (rc == SQLITE_OK) {
+            rc = sql[i] != NULL ? sqlite3_prepare_v2(standby, sql[i], -1, targets[i], 0) : SQLITE_NOMEM;
+        }
+        sqlite3_free(sql[i]);
+    }
+    sqlite3_free(columnList);
+    sqlite3_free(keyList);
+    sqlite3_free(keyMatch);
+    sqlite3_free(updateList);
+    sqlite3_free(conflict);
+    if (rc != SQLITE_OK) {
+        printf("Error preparing replication of %s: %s\n", name, sqlite3_errmsg(standby));
+    }
+    return rc;
+}
+
+static int seedStandby(sqlite3 *standby, ReplicaTable *tables, int count, long long *lastSeq) {
+    sqlite3_stmt *stmt;
+    int rc = SQLITE_OK;
+
+    for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+        if ((rc = stepDone(tables[i].seedRemove)) == SQLITE_OK) {
+            rc = stepDone(tables[i].seedCopy);
+        }
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(standby, "SELECT IFNULL((SELECT seq FROM source.sqlite_sequence "
+                                         "WHERE name = 'ATM_ReplicaLog'), 0)", -1, &stmt, 0);
+        if (rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            *lastSeq = sqlite3_column_int64(stmt, 0);
+            rc = SQLITE_OK;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return rc;
+}
+
+// Applies up to STANDBY_BATCH log entries; returns how many, or -1. A sequence gap
+// means the log was trimmed past this standby, which then needs seeding again.
+static int applyReplicaLog(sqlite3 *standby, ReplicaTable *tables, int count, long long *lastSeq,
+                           long long *lastChangeAt, int *gap) {
+    sqlite3_stmt *read;
+    int applied = 0, rc;
+
+    rc = sqlite3_prepare_v2(standby, "SELECT seq, tableName, rowKey, changedAt FROM source.ATM_ReplicaLog "
+                                     "WHERE seq > ? ORDER BY seq LIMIT ?", -1, &read, 0);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(read, 1, *lastSeq);
+        sqlite3_bind_int(read, 2, STANDBY_BATCH);
+    }
+    while (rc == SQLITE_OK && (rc = sqlite3_step(read)) == SQLITE_ROW) {
+        const char *name = (const char *)sqlite3_column_text(read, 1);
+        ReplicaTable *table = NULL;
+
+        if (sqlite3_column_int64(read, 0) != *lastSeq + 1) {
+            *gap = 1;
+            rc = SQLITE_DONE;
+            break;
+        }
+        for (int i = 0; i < count && name != NULL; i++) {
+            if (strcmp(tables[i].name, name) == 0) {
+                table = &tables[i];
+            }
+        }
+        if (table == NULL) {
+            printf("Replica log names unknown table %s.\n", name != NULL ? name : "(null)");
+            rc = SQLITE_ERROR;
+            break;
+        }
+        sqlite3_bind_value(table->remove, 1, sqlite3_column_value(read, 2));
+        sqlite3_bind_value(table->upsert, 1, sqlite3_column_value(read, 2));
+        if ((rc = stepDone(table->remove)) == SQLITE_OK) {
+            rc = stepDone(table->upsert);
+        }
+        *lastSeq = sqlite3_column_int64(read, 0);
+        *lastChangeAt = sqlite3_column_int64(read, 3);
+        applied++;
+    }
+    sqlite3_finalize(read);
+    return rc == SQLITE_DONE || rc == SQLITE_OK ? applied : -1;
+}
+
+// Replays one batch from the primary; returns the number of changes applied or -1.
+static int standbyCatchUp(sqlite3 *standby, long long *lagSeconds) {
+    ReplicaTable tables[REPLICATED_TABLES];
+    long long lastSeq = readMeta(standby, "replicaSeq");
+    long long lastChangeAt = 0;
+    int prepared = 0, applied = 0, gap = 0, rc = SQLITE_OK;
+    char trim[160];
+
+    while (prepared < REPLICATED_TABLES && rc == SQLITE_OK) {
+        rc = prepareReplicaTable(standby, replicatedTables[prepared], &tables[prepared]);
+        prepared++;
+    }
+    // Deferred, so the primary's snapshot is taken at the first read and held for the batch.
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(standby, "BEGIN", 0, 0, 0);
+    }
+    if (rc == SQLITE_OK && readMeta(standby, "replicaSeeded") != 0) {
+        applied = applyReplicaLog(standby, tables, REPLICATED_TABLES, &lastSeq, &lastChangeAt, &gap);
+        rc = applied < 0 ? SQLITE_ERROR : SQLITE_OK;
+        if (gap) {
+            printf("Standby is behind the primary's replica log; reseeding.\n");
+        }
+    }
+    if (rc == SQLITE_OK && (gap || readMeta(standby, "replicaSeeded") == 0)) {
+        rc = seedStandby(standby, tables, REPLICATED_TABLES, &lastSeq);
+        applied = 1;
+        if (rc == SQLITE_OK) {
+            rc = writeMeta(standby, "replicaSeeded", 1);
+        }
+    }
+    if (rc == SQLITE_OK) {
+        rc = writeMeta(standby, "replicaSeq", lastSeq);
+    }
+    // The standby's own triggers log what it applies; keep those logs to the primary's retention.
+    if (rc == SQLITE_OK) {
+        long long cutoff = (long long)time(NULL) - CHANGELOG_RETENTION;
+        snprintf(trim, sizeof(trim), "DELETE FROM main.ATM_ReplicaLog WHERE changedAt < %lld;"
+                                     "DELETE FROM main.ATM_ChangeLog WHERE changedAt < %lld;", cutoff, cutoff);
+        rc = sqlite3_exec(standby, trim, 0, 0, 0);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(standby, "COMMIT", 0, 0, 0);
+    }
+    if (rc != SQLITE_OK) {
+        printf("Standby catch-up failed: %s\n", sqlite3_errmsg(standby));
+        if (!sqlite3_get_autocommit(standby)) {
+            sqlite3_exec(standby, "ROLLBACK", 0, 0, 0);
+        }
+    }
+    finalizeReplicaTables(tables, prepared);
+    if (rc != SQLITE_OK) {
+        return -1;
+    }
+
+    if (lastChangeAt > 0) {
+        *lagSeconds = (long long)time(NULL) - lastChangeAt;
+    } else if (applied == 0) {
+        *lagSeconds = 0;
+    }
+    return applied;
+}
+
+static sqlite3 *openStandby(const char *standbyPath) {
+    sqlite3 *standby;
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI;
+
+    if (sqlite3_open_v2(standbyPath, &standby, flags, 0) != SQLITE_OK) {
+        printf("Error opening standby database %s.\n", standbyPath);
+        sqlite3_close(standby);
+        return NULL;
+    }
+    sqlite3_busy_timeout(standby, 5000);
+    sqlite3_exec(standby, "PRAGMA journal_mode = WAL", 0, 0, 0);
+    sqlite3_exec(standby, "PRAGMA synchronous = FULL", 0, 0, 0);
+    createSchema(standby);
+    if (attachDatabase(standby, dbPath, "source", 1) != SQLITE_OK) {
+        printf("Error attaching primary database %s: %s\n", dbPath, sqlite3_errmsg(standby));
+        sqlite3_close(standby);
+        return NULL;
+    }
+    return standby;
+}
+
+// Drains the primary into the standby and marks it promoted; the standby stays open.
+static int finishStandby(sqlite3 *standby) {
+    long long lagSeconds;
+    int applied;
+
+    while ((applied = standbyCatchUp(standby, &lagSeconds)) > 0) {
+    }
+    if (applied < 0 || sqlite3_exec(standby, "DETACH source", 0, 0, 0) != SQLITE_OK ||
+        writeMeta(standby, "promotedAt", (long long)time(NULL)) != SQLITE_OK ||
+        sqlite3_exec(standby, "PRAGMA wal_checkpoint(TRUNCATE)", 0, 0, 0) != SQLITE_OK) {
+        printf("Error finishing standby: %s\n", sqlite3_errmsg(standby));
+        return -1;
+    }
+    return 0;
+}
+
+int runStandby(const char *standbyPath, int intervalMs) {
+    char promoteFlag[256];
+    sqlite3 *standby = openStandby(standbyPath);
+    long long lagSeconds = 0;
+    time_t lastReport = 0;
+
+    // Only the attached copy is read from here on; holding the pool open would keep
+    // the primary in use and block promotion.
+    closeDatabasePool();
+    if (standby == NULL) {
+        return 1;
+    }
+    snprintf(promoteFlag, sizeof(promoteFlag), "%s.promote", standbyPath);
+    printf("Standby %s following %s\n", standbyPath, dbPath);
+    fflush(stdout);
+
+    while (access(promoteFlag, F_OK) != 0) {
+        int applied = standbyCatchUp(standby, &lagSeconds);
+
+        if (time(NULL) - lastReport >= STANDBY_REPORT_SECONDS) {
+            printf("Standby at change %lld, lag %llds%s\n", readMeta(standby, "replicaSeq"), lagSeconds,
+                   applied < 0 ? " (primary unavailable)" : "");
+            fflush(stdout);
+            lastReport = time(NULL);
+        }
+        if (applied < STANDBY_BATCH) {
+            usleep((useconds_t)intervalMs * 1000);
+        }
+    }
+
+    // Promotion: drain whatever the primary still has, then stop following it.
+    int failed = finishStandby(standby) != 0;
+    sqlite3_close(standby);
+    unlink(promoteFlag);
+    if (failed) {
+        return 1;
+    }
+    printf("Standby %s promoted.\n", standbyPath);
+    return 0;
+}
+
+// SQLite keeps a shared lock on the deadman-switch byte of a WAL database's -shm
+// file for as long as a connection has it open, so a conflicting lock there means
+// another process is still attached. POSIX locks never conflict within a process,
+// so this process must have closed its own connections first.
+static int databaseInUse(const char *path) {
+    char shm[PATH_MAX];
+    struct flock lock = {0};
+
+    snprintf(shm, sizeof(shm), "%s-shm", path);
+    int fd = open(shm, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 128;
+    lock.l_len = 1;
+    int inUse = fcntl(fd, F_GETLK, &lock) != 0 || lock.l_type != F_UNLCK;
+    close(fd);
+    return inUse;
+}
+
+static int moveDatabase(const char *from, const char *to) {
+    const char *suffixes[] = {"", "-wal", "-shm"};
+    char source[PATH_MAX + 8], target[PATH_MAX + 8];
+
+    for (int i = 0; i < 3; i++) {
+        snprintf(source, sizeof(source), "%s%s", from, suffixes[i]);
+        snprintf(target, sizeof(target), "%s%s", to, suffixes[i]);
+        if (rename(source, target) != 0 && (i == 0 || errno != ENOENT)) {
+            printf("Error moving %s to %s: %s\n", source, target, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Asks a running standby to finish, then moves the standby file into the primary's
+// place; the old primary (with its WAL files) is kept alongside for inspection.
+// Nothing is moved while any other process still has either database open.
+int promoteStandby(const char *standbyPath) {
+    char promoteFlag[256], failedPath[PATH_MAX];
+
+    snprintf(promoteFlag, sizeof(promoteFlag), "%s.promote", standbyPath);
+    FILE *flag = fopen(promoteFlag, "w");
+    if (flag == NULL) {
+        printf("Error requesting promotion of %s.\n", standbyPath);
+        return 1;
+    }
+    fclose(flag);
+
+    for (int waited = 0; access(promoteFlag, F_OK) == 0 && waited < STANDBY_PROMOTE_WAIT_MS; waited += 50) {
+        usleep(50 * 1000);
+    }
+    if (access(promoteFlag, F_OK) == 0) {
+        // No standby process is running; finish the catch-up here instead.
+        unlink(promoteFlag);
+        sqlite3 *standby = openStandby(standbyPath);
+        if (standby == NULL) {
+            return 1;
+        }
+        int failed = finishStandby(standby) != 0;
+        sqlite3_close(standby);
+        if (failed) {
+            return 1;
+        }
+    }
+    closeDatabasePool();
+
+    if (databaseInUse(dbPath) || databaseInUse(standbyPath)) {
+        printf("Not promoting: %s or %s is still open in another process. Stop the terminals "
+               "and servers using it, then run promote again.\n", dbPath, standbyPath);
+        return 1;
+    }
+    snprintf(failedPath, sizeof(failedPath), "%s.failed-%lld", dbPath, (long long)time(NULL));
+    if (moveDatabase(dbPath, failedPath) != 0) {
+        return 1;
+    }
+    if (moveDatabase(standbyPath, dbPath) != 0) {
+        moveDatabase(failedPath, dbPath);
+        return 1;
+    }
+    printf("Promoted %s to %s; previous primary kept as %s.\n", standbyPath, dbPath, failedPath);
+    return 0;
+}
+
+// Interest and fee accrual. The card id space is cut into ACCRUAL_CHUNK-sized ranges
+// that worker threads claim in turn. A worker reads and prices its range on its own
+// reader connection, then applies it in one short writer transaction together with
+// the ledger rows and a row in ATM_BatchChunks marking the range done. Re-running a
+// job with the same name skips the finished ranges, so a crash loses at most the
+// chunks that were in flight.
+typedef struct {
+    pthread_mutex_t lock;
+    const char *job;
+    double rate;
+    int minId;
+    int chunks;
+    int nextChunk;
+    long accounts;
+    long skippedChunks;
+    double total;
+} AccrualJob;
+
+typedef struct {
+    int id;
+    double delta;
+} AccrualEntry;
+
+static int chunkDone(sqlite3 *db, const char *job, int chunkStart) {
+    sqlite3_stmt *stmt;
+    int done = 0;
+
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM ATM_BatchChunks WHERE job = ? AND chunkStart = ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, job, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, chunkStart);
+        done = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    return done;
+}
+
+static int applyAccrualChunk(AccrualJob *job, int chunkStart, AccrualEntry *entries, int count, double *total) {
+    const char *type = job->rate < 0 ? "Fee" : "Interest";
+    sqlite3 *db = dbWriterAcquire();
+    sqlite3_stmt *update;
+    sqlite3_stmt *mark;
+    int applied = 0;
+
+    if (db == NULL) {
+        return -1;
+    }
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK) {
+        dbWriterRelease();
+        return -1;
+    }
+    if (chunkDone(db, job->job, chunkStart)) {
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        dbWriterRelease();
+        return 0;
+    }
+
+    // Relative update, so a withdrawal that slipped in since the read is not lost.
+    sqlite3_prepare_v2(db, "UPDATE ATM_Cards SET balance = ROUND(balance + ?, 2) WHERE id = ? RETURNING balance", -1, &update, 0);
+    for (int i = 0; i < count; i++) {
+        sqlite3_bind_double(update, 1, entries[i].delta);
+        sqlite3_bind_int(update, 2, entries[i].id);
+        if (sqlite3_step(update) == SQLITE_ROW) {
+            double newBalance = sqlite3_column_double(update, 0);
+            sqlite3_reset(update);
+            insertTransaction(db, entries[i].id, type, entries[i].delta, newBalance - entries[i].delta, newBalance);
+            *total += entries[i].delta;
+            applied++;
+        } else {
+            sqlite3_reset(update);
+        }
+    }
+    sqlite3_finalize(update);
+
+    sqlite3_prepare_v2(db, "INSERT INTO ATM_BatchChunks (job, chunkStart, accounts) VALUES (?, ?, ?)", -1, &mark, 0);
+    sqlite3_bind_text(mark, 1, job->job, -1, SQLITE_STATIC);
+    sqlite3_bind_int(mark, 2, chunkStart);
+    sqlite3_bind_int(mark, 3, applied);
+    sqlite3_step(mark);
+    sqlite3_finalize(mark);
+
+    if (sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        dbWriterRelease();
+        return -1;
+    }
+    dbWriterRelease();
+    return applied;
+}
+
+static void *accrualWorker(void *arg) {
+    AccrualJob *job = arg;
+    AccrualEntry *entries = malloc(sizeof(AccrualEntry) * ACCRUAL_CHUNK);
+    sqlite3 *db = dbReader();
+    sqlite3_stmt *stmt;
+
+    setWriterPriority(ADMIT_BATCH);
+
+    if (entries == NULL || db == NULL ||
+        sqlite3_prepare_v2(db, "SELECT id, balance FROM ATM_Cards WHERE id BETWEEN ? AND ? AND balance > 0",
+                           -1, &stmt, 0) != SQLITE_OK) {
+        free(entries);
+        return NULL;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int chunk = job->nextChunk++;
+        pthread_mutex_unlock(&job->lock);
+        if (chunk >= job->chunks) {
+            break;
+        }
+
+        int chunkStart = job->minId + chunk * ACCRUAL_CHUNK;
+        if (chunkDone(db, job->job, chunkStart)) {
+            pthread_mutex_lock(&job->lock);
+            job->skippedChunks++;
+            pthread_mutex_unlock(&job->lock);
+            continue;
+        }
+
+        int count = 0;
+        sqlite3_bind_int(stmt, 1, chunkStart);
+        sqlite3_bind_int(stmt, 2, chunkStart + ACCRUAL_CHUNK - 1);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            double delta = round(sqlite3_column_double(stmt, 1) * job->rate) / 100.0;
+            if (delta != 0) {
+                entries[count].id = sqlite3_column_int(stmt, 0);
+                entries[count].delta = delta;
+                count++;
+            }
+        }
+        sqlite3_reset(stmt);
+
+        double total = 0;
+        int applied = applyAccrualChunk(job, chunkStart, entries, count, &total);
+        if (applied < 0) {
+            printf("Chunk starting at card %d failed; re-run the job to retry it.\n", chunkStart);
+            continue;
+        }
+        pthread_mutex_lock(&job->lock);
+        job->accounts += applied;
+        job->total += total;
+        pthread_mutex_unlock(&job->lock);
+    }
+    sqlite3_finalize(stmt);
+    free(entries);
+    return NULL;
+}
+
+int runAccrual(const char *jobName, double ratePercent, int threads) {
+    sqlite3 *db = dbWriterAcquire();
+    sqlite3_stmt *stmt;
+    AccrualJob job;
+    int minId = 0, maxId = -1;
+    int rateMatches = 1;
+
+    if (db == NULL) {
+        return 1;
+    }
+    // The rate is pinned on first run so a resumed job cannot change it half way.
+    if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO ATM_BatchJobs (job, rate, startedAt) VALUES (?, ?, ?)",
+                           -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, jobName, -1, SQLITE_STATIC);
+        sqlite3_bind_double(stmt, 2, ratePercent);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+        sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+    if (sqlite3_prepare_v2(db, "SELECT rate FROM ATM_BatchJobs WHERE job = ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, jobName, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_double(stmt, 0) != ratePercent) {
+            printf("Job %s was started with a rate of %.4f%%.\n", jobName, sqlite3_column_double(stmt, 0));
+            rateMatches = 0;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (sqlite3_prepare_v2(db, "SELECT MIN(id), MAX(id) FROM ATM_Cards", -1, &stmt, 0) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        minId = sqlite3_column_int(stmt, 0);
+        maxId = sqlite3_column_int(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+    dbWriterRelease();
+    if (!rateMatches) {
+        return 1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.lock, 0);
+    job.job = jobName;
+    job.rate = ratePercent;
+    job.minId = minId;
+    job.chunks = maxId < minId ? 0 : (maxId - minId) / ACCRUAL_CHUNK + 1;
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], 0, accrualWorker, &job);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], 0);
+    }
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+
+    printf("Job %s: %ld accounts updated, £%.2f applied, %ld chunk(s) already done.\n",
+           jobName, job.accounts, job.total, job.skippedChunks);
+    return 0;
+}
+
+// Standing orders. Pending orders live in a binary min-heap keyed by next run time,
+// so each tick pops exactly the due orders instead of scanning the table. Due orders
+// are re-read by id (so cancellations and amount changes take effect) and paid in
+// batches of up to SCHEDULER_BATCH per writer transaction. Each payment is keyed by
+// its (orderId, dueTime) pair in ATM_OrderPayments, which also serves as the history
+// of scheduled payments.
+typedef struct {
+    long long due;
+    int orderId;
+} ScheduledOrder;
+
+typedef struct {
+    ScheduledOrder *entries;
+    size_t count;
+    size_t capacity;
+    int maxOrderId;
+} OrderHeap;
+
+typedef struct {
+    int orderId;
+    int fromId;
+    int active;
+    int repeated;
+    int result;
+    double amount;
+    double newBalance;
+    long long nextRun;
+} OrderPayment;
+
+static int heapPush(OrderHeap *heap, long long due, int orderId) {
+    if (heap->count == heap->capacity) {
+        size_t capacity = heap->capacity ? heap->capacity * 2 : 1024;
+        ScheduledOrder *entries = realloc(heap->entries, capacity * sizeof(ScheduledOrder));
+        if (entries == NULL) {
+            return -1;
+        }
+        heap->entries = entries;
+        heap->capacity = capacity;
+    }
+    size_t i = heap->count++;
+    while (i > 0 && heap->entries[(i - 1) / 2].due > due) {
+        heap->entries[i] = heap->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->entries[i].due = due;
+    heap->entries[i].orderId = orderId;
+    return 0;
+}
+
+static ScheduledOrder heapPop(OrderHeap *heap) {
+    ScheduledOrder top = heap->entries[0];
+    ScheduledOrder last = heap->entries[--heap->count];
+    size_t i = 0;
+
+    while (2 * i + 1 < heap->count) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < heap->count && heap->entries[child + 1].due < heap->entries[child].due) {
+            child++;
+        }
+        if (heap->entries[child].due >= last.due) {
+            break;
+        }
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    if (heap->count > 0) {
+        heap->entries[i] = last;
+    }
+    return top;
+}
+
+// Loads active orders created since the last call; the first call loads them all.
+int loadStandingOrders(OrderHeap *heap) {
+    sqlite3 *db = dbReader();
+    sqlite3_stmt *stmt;
+    int loaded = 0;
+
+    if (db == NULL || sqlite3_prepare_v2(db, "SELECT id, nextRun FROM ATM_StandingOrders WHERE id > ? AND active = 1",
+                                         -1, &stmt, 0) != SQLITE_OK) {
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, heap->maxOrderId);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int orderId = sqlite3_column_int(stmt, 0);
+        if (heapPush(heap, sqlite3_column_int64(stmt, 1), orderId) != 0) {
+            break;
+        }
+        if (orderId > heap->maxOrderId) {
+            heap->maxOrderId = orderId;
+        }
+        loaded++;
+    }
+    sqlite3_finalize(stmt);
+    return loaded;
+}
+
+int addStandingOrder(int fromId, int toId, double amount, int intervalSeconds, long long firstRun) {
+    sqlite3 *db = dbWriterAcquire();
+    sqlite3_stmt *stmt;
+    int orderId = -1;
+
+    if (db == NULL) {
+        return -1;
+    }
+    if (sqlite3_prepare_v2(db, "INSERT INTO ATM_StandingOrders (fromCard, toCard, amount, intervalSeconds, nextRun, active) "
+                               "VALUES (?, ?, ?, ?, ?, 1)", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, fromId);
+        sqlite3_bind_int(stmt, 2, toId);
+        sqlite3_bind_double(stmt, 3, amount);
+        sqlite3_bind_int(stmt, 4, intervalSeconds);
+        sqlite3_bind_int64(stmt, 5, firstRun);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            orderId = (int)sqlite3_last_insert_rowid(db);
+        }
+    }
+    sqlite3_finalize(stmt);
+    dbWriterRelease();
+    return orderId;
+}
+
+void cancelStandingOrder(int orderId) {
+    sqlite3 *db;
+    char sql[100];
+
+    if ((db = dbWriterAcquire()) == NULL) {
+        return;
+    }
+    sprintf(sql, "UPDATE ATM_StandingOrders SET active = 0 WHERE id = %d", orderId);
+    sqlite3_exec(db, sql, 0, 0, 0);
+    dbWriterRelease();
+}
+
+// Pays a batch of due orders in one writer transaction: each order is re-read, its
+// (orderId, dueTime) pair claimed in ATM_OrderPayments, both balances and ledger
+// rows written and nextRun advanced, so a crash either keeps the whole batch or
+// none of it. A pair that is already claimed (another scheduler got there first)
+// only moves nextRun on.
+static int payOrderBatch(sqlite3 *db, const ScheduledOrder *batch, OrderPayment *payments, int count, long long now) {
+    sqlite3_stmt *order = NULL, *claimed = NULL, *claim = NULL, *balance = NULL, *advance = NULL;
+    int rc = sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0);
+
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "SELECT fromCard, toCard, amount, intervalSeconds, active "
+                                    "FROM ATM_StandingOrders WHERE id = ?", -1, &order, 0);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "SELECT 1 FROM ATM_OrderPayments WHERE orderId = ? AND dueTime = ?", -1, &claimed, 0);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "INSERT INTO ATM_OrderPayments (orderId, dueTime, result, paidAt) "
+                                    "VALUES (?, ?, ?, ?)", -1, &claim, 0);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "UPDATE ATM_Cards SET balance = ? WHERE id = ?", -1, &balance, 0);
+    }
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db, "UPDATE ATM_StandingOrders SET nextRun = ? WHERE id = ?", -1, &advance, 0);
+    }
+
+    for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+        OrderPayment *payment = &payments[i];
+        memset(payment, 0, sizeof(*payment));
+        payment->orderId = batch[i].orderId;
+
+        sqlite3_bind_int(order, 1, batch[i].orderId);
+        if ((rc = sqlite3_step(order)) != SQLITE_ROW) {
+            rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+            sqlite3_reset(order);
+            continue;
+        }
+        rc = SQLITE_OK;
+        payment->active = sqlite3_column_int(order, 4);
+        payment->fromId = sqlite3_column_int(order, 0);
+        int toId = sqlite3_column_int(order, 1);
+        payment->amount = sqlite3_column_double(order, 2);
+        long long interval = sqlite3_column_int64(order, 3) > 0 ? sqlite3_column_int64(order, 3) : 1;
+        sqlite3_reset(order);
+        if (!payment->active) {
+            continue;
+        }
+        payment->nextRun = batch[i].due + interval;
+        while (payment->nextRun <= now) {
+            payment->nextRun += interval;
+        }
+
+        sqlite3_bind_int(claimed, 1, batch[i].orderId);
+        sqlite3_bind_int64(claimed, 2, batch[i].due);
+        rc = sqlite3_step(claimed);
+        sqlite3_reset(claimed);
+        payment->repeated = rc == SQLITE_ROW;
+        rc = rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+
+        if (rc == SQLITE_OK && !payment->repeated) {
+            double fromBalance, toBalance;
+            int fromBlocked, toBlocked;
+
+            payment->result = TX_DECLINED;
+            if (!readBalance(db, payment->fromId, &fromBalance, &fromBlocked) ||
+                !readBalance(db, toId, &toBalance, &toBlocked)) {
+                payment->result = TX_ERROR;
+            } else if (!fromBlocked && !toBlocked && payment->amount > 0 && fromBalance >= payment->amount &&
+                       toId != payment->fromId) {
+                int ids[2] = {payment->fromId < toId ? payment->fromId : toId, payment->fromId < toId ? toId : payment->fromId};
+
+                payment->result = TX_OK;
+                payment->newBalance = fromBalance - payment->amount;
+                for (int k = 0; k < 2 && rc == SQLITE_OK; k++) {
+                    sqlite3_bind_double(balance, 1, ids[k] == payment->fromId ? payment->newBalance : toBalance + payment->amount);
+                    sqlite3_bind_int(balance, 2, ids[k]);
+                    rc = stepDone(balance);
+                }
+                insertTransaction(db, payment->fromId, "Transfer Out", -payment->amount, fromBalance, payment->newBalance);
+                insertTransaction(db, toId, "Transfer In", payment->amount, toBalance, toBalance + payment->amount);
+            }
+            if (rc == SQLITE_OK) {
+                sqlite3_bind_int(claim, 1, batch[i].orderId);
+                sqlite3_bind_int64(claim, 2, batch[i].due);
+                sqlite3_bind_int(claim, 3, payment->result);
+                sqlite3_bind_int64(claim, 4, now);
+                rc = stepDone(claim);
+            }
+        }
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int64(advance, 1, payment->nextRun);
+            sqlite3_bind_int(advance, 2, batch[i].orderId);
+            rc = stepDone(advance);
+        }
+    }
+
+    sqlite3_finalize(order);
+    sqlite3_finalize(claimed);
+    sqlite3_finalize(claim);
+    sqlite3_finalize(balance);
+    sqlite3_finalize(advance);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    }
+    if (rc != SQLITE_OK) {
+        printf("Error paying standing orders: %s\n", sqlite3_errmsg(db));
+        if (!sqlite3_get_autocommit(db)) {
+            sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int dispatchDueOrders(OrderHeap *heap, long long now) {
+    ScheduledOrder batch[SCHEDULER_BATCH];
+    OrderPayment payments[SCHEDULER_BATCH];
+    int paid = 0;
+
+    while (heap->count > 0 && heap->entries[0].due <= now) {
+        int count = 0;
+        while (count < SCHEDULER_BATCH && heap->count > 0 && heap->entries[0].due <= now) {
+            batch[count++] = heapPop(heap);
+        }
+
+        sqlite3 *db = dbWriterAcquire();
+        int failed = db == NULL || payOrderBatch(db, batch, payments, count, now) != 0;
+        if (db != NULL) {
+            dbWriterRelease();
+        }
+        if (failed) {
+            // Nothing was committed; keep the orders due for the next tick.
+            for (int i = 0; i < count; i++) {
+                heapPush(heap, batch[i].due, batch[i].orderId);
+            }
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const OrderPayment *payment = &payments[i];
+            if (!payment->active) {
+                continue;
+            }
+            heapPush(heap, payment->nextRun, payment->orderId);
+            if (payment->repeated) {
+                continue;
+            }
+            auditEvent(payment->fromId, AUDIT_TRANSFER, payment->amount, payment->newBalance, payment->result);
+            if (payment->result == TX_OK) {
+                paid++;
+            } else {
+                printf("Standing order %d from card %d was not paid.\n", payment->orderId, payment->fromId);
+            }
+        }
+    }
+    return paid;
+}
+
+int runScheduler(int tickSeconds) {
+    OrderHeap heap = {NULL, 0, 0, 0};
+
+    setWriterPriority(ADMIT_BATCH);
+
+    if (loadStandingOrders(&heap) < 0) {
+        printf("Error loading standing orders.\n");
+        return 1;
+    }
+    printf("Scheduler started with %zu standing order(s).\n", heap.count);
+    fflush(stdout);
+    while (1) {
+        loadStandingOrders(&heap);
+        maintainIfDue();
+        int paid = dispatchDueOrders(&heap, (long long)time(NULL));
+        if (paid > 0) {
+            printf("Paid %d standing order(s); %zu pending.\n", paid, heap.count);
+            fflush(stdout);
+        }
+        sleep((unsigned int)tickSeconds);
+    }
+}
+
+// Discards the rest of a malformed input line. At end of input no further line
+// can arrive, so the console exits instead of re-prompting forever.
+static void skipLine() {
+    int c;
+    while ((c = getchar()) != '\n') {
+        if (c == EOF) {
+            closeDatabasePool();
+            exit(0);
+        }
+    }
+}
+
+// Store-and-forward. With ATM_OFFLINE_DIR set, the console keeps a snapshot of card
+// state in cards.snap, refreshed at startup while the database is reachable, and
+// falls back to it when the database cannot be read. Offline, only deposits and
+// withdrawals within OFFLINE_WITHDRAW_LIMIT per card (and within the snapshot
+// balance) are allowed, and each is appended to journal.log and fsync'd before any
+// cash moves. Once the database is back the journal is replayed in batches through
+// processCashRequest under the journaled request ids, so an interrupted replay can
+// simply run again; operations the bank now rejects go to conflicts.log.
+typedef struct {
+    uint32_t magic;
+    uint32_t recordSize;
+    int64_t createdAt;
+    int64_t count;
+} OfflineSnapshotHeader;
+
+// One card in cards.snap: only what offline authorization reads, in fixed-width
+// fields, so the file never carries owner names or PIN hashes and does not depend
+// on the layout of Card. Records are sorted by id. In place of the hash a record
+// keeps the salt and iteration count with just OFFLINE_PIN_CHECK_MASK bits of the
+// derived key: enough to turn away all but about one wrong PIN in a thousand, while
+// a copied snapshot still leaves some ten candidates for every PIN. Cards still on a
+// plain PIN have pinIterations 0 and cannot be used offline.
+typedef struct {
+    int32_t id;
+    int32_t blocked;
+    int32_t failedAttempts;
+    int32_t pinIterations;
+    int64_t balancePence;
+    uint8_t pinSalt[PIN_SALT_SIZE];
+    uint16_t pinCheck;
+    uint16_t reserved[3];
+} OfflineCardRecord;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;
+    int64_t requestId;
+    int32_t cardId;
+    int32_t terminalId;
+    int32_t op;
+    int32_t reserved;
+    int64_t amountPence;
+    int64_t timestamp;
+} OfflineEntry;
+
+static uint32_t offlineChecksum(const OfflineEntry *entry) {
+    return crc32(&entry->requestId, sizeof(OfflineEntry) - offsetof(OfflineEntry, requestId));
+}
+
+int databaseAvailable() {
+    sqlite3 *db = dbReader();
+    sqlite3_stmt *stmt;
+    int rc;
+
+    if (db == NULL || sqlite3_prepare_v2(db, "SELECT 1 FROM ATM_Cards LIMIT 1", -1, &stmt, 0) != SQLITE_OK) {
+        return 0;
+    }
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_ROW || rc == SQLITE_DONE;
+}
+
+int offlineSaveSnapshot(const char *dir) {
+    char path[300], tempPath[310];
+    sqlite3 *db = dbReader();
+    sqlite3_stmt *stmt;
+    OfflineSnapshotHeader header = {OFFLINE_MAGIC, sizeof(OfflineCardRecord), (int64_t)time(NULL), 0};
+    FILE *file;
+    int fd, rc = SQLITE_ERROR;
+
+    snprintf(path, sizeof(path), "%s/cards.snap", dir);
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    if (db == NULL) {
+        return -1;
+    }
+    // Owner-only from the first byte; fchmod covers a temp file left by a crash.
+    if ((fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        return -1;
+    }
+    if (fchmod(fd, 0600) != 0 || (file = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        unlink(tempPath);
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    if (sqlite3_prepare_v2(db, "SELECT id, pinHash, balance, blocked, failedAttempts FROM ATM_Cards ORDER BY id", -1, &stmt, 0) == SQLITE_OK) {
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            OfflineCardRecord record;
+            const char *pinHash = (const char *)sqlite3_column_text(stmt, 1);
+            uint8_t key[32];
+            memset(&record, 0, sizeof(record));
+            record.id = sqlite3_column_int(stmt, 0);
+            if (pinHash == NULL || isLegacyPin(pinHash) || !parsePinHash(pinHash, &record.pinIterations, record.pinSalt, key)) {
+                record.pinIterations = 0;
+            } else {
+                record.pinCheck = (uint16_t)(((key[0] << 8) | key[1]) & OFFLINE_PIN_CHECK_MASK);
+            }
+            record.balancePence = llround(sqlite3_column_double(stmt, 2) * 100);
+            record.blocked = sqlite3_column_int(stmt, 3);
+            record.failedAttempts = sqlite3_column_int(stmt, 4);
+            fwrite(&record, sizeof(record), 1, file);
+            header.count++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    rewind(file);
+    fwrite(&header, sizeof(header), 1, file);
+    if (rc != SQLITE_DONE || ferror(file) || fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        fclose(file);
+        unlink(tempPath);
+        return -1;
+    }
+    fclose(file);
+    if (rename(tempPath, path) != 0) {
+        unlink(tempPath);
+        return -1;
+    }
+    return (int)header.count;
+}
+
+// Sums the card's journaled withdrawals and reports whether a block is pending, so
+// a card blocked offline stays blocked until the journal reaches the bank.
+static int offlineJournalScan(const char *dir, int cardId, int64_t *withdrawnPence) {
+    char path[300];
+    OfflineEntry entry;
+    int blocked = 0;
+
+    *withdrawnPence = 0;
+    snprintf(path, sizeof(path), "%s/journal.log", dir);
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    while (fread(&entry, sizeof(entry), 1, file) == 1) {
+        if (entry.magic != OFFLINE_MAGIC || entry.crc != offlineChecksum(&entry) || entry.cardId != cardId) {
+            continue;
+        }
+        if (entry.op == OFFLINE_WITHDRAW) {
+            *withdrawnPence += entry.amountPence;
+        } else if (entry.op == OFFLINE_BLOCK) {
+            blocked = 1;
+        }
+    }
+    fclose(file);
+    return blocked;
+}
+
+// Binary search over the sorted snapshot with pread, so no more than a few pages
+// of the file are read per lookup.
+static int offlineFindRecord(const char *dir, int cardId, OfflineCardRecord *record) {
+    char path[300];
+    OfflineSnapshotHeader header;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "%s/cards.snap", dir);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == OFFLINE_MAGIC &&
+        header.recordSize == sizeof(OfflineCardRecord) && time(NULL) - header.createdAt <= OFFLINE_SNAPSHOT_MAX_AGE) {
+        int64_t low = 0, high = header.count - 1;
+        while (low <= high && !found) {
+            int64_t middle = low + (high - low) / 2;
+            if (pread(fd, record, sizeof(*record), (off_t)(sizeof(header) + middle * sizeof(*record))) != sizeof(*record)) {
+                break;
+            }
+            if (record->id == cardId) {
+                found = 1;
+            } else if (record->id < cardId) {
+                low = middle + 1;
+            } else {
+                high = middle - 1;
+            }
+        }
+    }
+    close(fd);
+    return found;
+}
+
+// The card comes back without a PIN hash or owner name; offlineVerifyPin checks
+// PINs against the snapshot.
+int offlineFetchCard(const char *dir, int cardId, Card *card) {
+    OfflineCardRecord record;
+    int64_t pence;
+
+    if (!offlineFindRecord(dir, cardId, &record)) {
         return 0;
     }
+    memset(card, 0, sizeof(*card));
+    card->id = record.id;
+    card->balance = record.balancePence / 100.0;
+    card->blocked = record.blocked;
+    card->failedAttempts = record.failedAttempts;
+    if (offlineJournalScan(dir, cardId, &pence)) {
+        card->blocked = 1;
+    }
+    card->balance -= pence / 100.0; // Offline deposits are not spendable until posted
+    return 1;
 }
 
-int depositMoney(Card *card, double amount) {
-    if (amount > 0) {
-        double oldBalance = card->balance;
-        card->balance += amount;
-        updateBalance(card->id, card->balance);
-        printf("Deposit successful. New balance: £%.2f\n", card->balance);
+int offlineVerifyPin(const char *dir, int cardId, int pin) {
+    OfflineCardRecord record;
+    uint8_t key[32];
 
-        if (wantsReceipt()) {
-            printReceipt(card, "Deposit", amount, oldBalance);
-        }
-        return 1;
-    } else {
-        printf("Invalid deposit amount.\n");
+    if (!offlineFindRecord(dir, cardId, &record) || record.pinIterations < 1) {
         return 0;
     }
+    pinKey(pin, record.pinSalt, record.pinIterations, key);
+    return (((key[0] << 8) | key[1]) & OFFLINE_PIN_CHECK_MASK) == record.pinCheck;
 }
 
-void printReceipt(Card *card, const char *transactionType, double amount, double oldBalance) {
-    printf("\n--- Transaction Receipt ---\n");
-    printf("Card ID: %d\n", card->id);
-    printf("Owner: %s\n", card->ownerName);
-    printf("Transaction: %s\n", transactionType);
-    printf("Amount: £%.2f\n", amount);
-    printf("Old Balance: £%.2f\n", oldBalance);
-    printf("New Balance: £%.2f\n", card->balance);
-    printf("---------------------------\n");
+int offlineRecord(const char *dir, int op, int cardId, double amount) {
+    char path[300];
+    OfflineEntry entry;
+
+    snprintf(path, sizeof(path), "%s/journal.log", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.magic = OFFLINE_MAGIC;
+    entry.requestId = newRequestId();
+    entry.cardId = cardId;
+    entry.terminalId = currentTerminal();
+    entry.op = op;
+    entry.amountPence = llround(amount * 100);
+    entry.timestamp = (int64_t)time(NULL);
+    entry.crc = offlineChecksum(&entry);
+    int ok = write(fd, &entry, sizeof(entry)) == sizeof(entry) && fsync(fd) == 0;
+    close(fd);
+    return ok ? 0 : -1;
 }
 
-int wantsReceipt() {
-    char response;
-    printf("Do you want to print a receipt? (y/n):\n> ");
-    scanf(" %c", &response);
-    return (response == 'y' || response == 'Y');
+double offlineWithdrawn(const char *dir, int cardId) {
+    int64_t pence;
+    offlineJournalScan(dir, cardId, &pence);
+    return pence / 100.0;
 }
 
-int isWeakPin(int pin) {
-    if (pin == 0) return 1; // запрещаем 0000
+int offlinePending(const char *dir) {
+    char path[300];
+    struct stat info;
 
-    const int weakPins[] = {
-        1234, 4321, 9876, 5432, 6789, 8765, 1111,
-        2222, 3333, 4444, 5555, 6666, 7777, 8888, 9999
-    };
-    int i;
-    for (i = 0; i < sizeof(weakPins) / sizeof(weakPins[0]); i++) {
-        if (pin == weakPins[i]) {
-            return 1;
-        }
-    }
+    snprintf(path, sizeof(path), "%s/journal.log", dir);
+    return stat(path, &info) == 0 && info.st_size >= (off_t)sizeof(OfflineEntry);
+}
 
-    int firstDigit = pin / 1000;
-    if (pin == firstDigit * 1111) {
-        return 1;
+// Returns the number of conflicts, or -1 if the database went away again; in that
+// case the journal is kept whole and the next replay repeats the applied entries
+// harmlessly.
+int offlineReplay(const char *dir) {
+    char path[300], conflictPath[300];
+    OfflineEntry batch[OFFLINE_REPLAY_BATCH];
+    size_t count;
+    int conflicts = 0, replayed = 0;
+    int savedTerminal = sessionTerminal;
+
+    snprintf(path, sizeof(path), "%s/journal.log", dir);
+    snprintf(conflictPath, sizeof(conflictPath), "%s/conflicts.log", dir);
+    FILE *journal = fopen(path, "rb");
+    if (journal == NULL) {
+        return 0;
     }
+    while ((count = fread(batch, sizeof(OfflineEntry), OFFLINE_REPLAY_BATCH, journal)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            OfflineEntry *entry = &batch[i];
+            Card card = {entry->cardId, "", 0, 0, "", 0};
+            double oldBalance;
+            int result;
 
-    return 0;
+            if (entry->magic != OFFLINE_MAGIC || entry->crc != offlineChecksum(entry)) {
+                continue; // Torn write at the tail of the journal
+            }
+            sessionTerminal = entry->terminalId;
+            if (entry->op == OFFLINE_BLOCK) {
+                blockCard(entry->cardId);
+                result = TX_OK;
+            } else {
+                double amount = entry->amountPence / 100.0;
+                result = processCashRequest(&card, entry->op == OFFLINE_WITHDRAW ? "Withdrawal" : "Deposit",
+                                            entry->op == OFFLINE_WITHDRAW ? -amount : amount, entry->requestId, &oldBalance);
+            }
+            sessionTerminal = savedTerminal;
+            // A card that no longer exists also fails with TX_ERROR; only stop while
+            // the database itself is unreachable, otherwise the journal never drains.
+            if (result == TX_ERROR && !databaseAvailable()) {
+                fclose(journal);
+                return -1;
+            }
+            if (result != TX_OK) {
+                FILE *log = fopen(conflictPath, "a");
+                if (log != NULL) {
+                    fprintf(log, "%lld request=%lld card=%d terminal=%d op=%s amount=%.2f result=%s\n",
+                            (long long)entry->timestamp, (long long)entry->requestId, entry->cardId, entry->terminalId,
+                            entry->op == OFFLINE_WITHDRAW ? "withdrawal" : "deposit", entry->amountPence / 100.0,
+                            result == TX_BLOCKED ? "blocked" : result == TX_DECLINED ? "declined" :
+                            result == TX_INVALID ? "duplicate" : "error");
+                    fclose(log);
+                }
+                printf("Offline %s of £%.2f on card %d was rejected by the bank; see %s.\n",
+                       entry->op == OFFLINE_WITHDRAW ? "withdrawal" : "deposit", entry->amountPence / 100.0,
+                       entry->cardId, conflictPath);
+                conflicts++;
+            }
+            replayed++;
+        }
+    }
+    fclose(journal);
+    if (truncate(path, 0) != 0) {
+        return -1;
+    }
+    if (replayed > 0) {
+        printf("Replayed %d offline operation(s), %d conflict(s).\n", replayed, conflicts);
+    }
+    return conflicts;
 }
 
-int isValidPin(int pin) {
-    return pin >= 0 && pin <= 9999;
+void handleOfflineTransaction(Card *card, const char *dir) {
+    int option;
+    double amount;
+
+    while (1) {
+        double available = OFFLINE_WITHDRAW_LIMIT - offlineWithdrawn(dir, card->id);
+        if (available > card->balance) {
+            available = card->balance;
+        }
+        printf("\nThe bank is unreachable; a limited service is available.\n");
+        printf("1. Available to withdraw\n");
+        printf("2. Withdraw Money\n");
+        printf("3. Deposit Money\n");
+        printf("7. Eject Card\n> ");
+        if (scanf("%d", &option) != 1) {
+            printf("Invalid transaction.\n");
+            skipLine();
+            continue;
+        }
+
+        switch (option) {
+            case 1:
+                printf("Available to withdraw: £%.2f\n", available > 0 ? available : 0);
+                break;
+            case 2:
+                printf("Enter amount to withdraw:\n> ");
+                if (scanf("%lf", &amount) != 1) {
+                    printf("Invalid transaction.\n");
+                    skipLine();
+                    break;
+                }
+                if (amount <= 0 || (int)amount % 5 != 0) {
+                    printf("Error: Withdrawal amount must be divisible by 5, 10, or 20.\n");
+                } else if (amount > available) {
+                    printf("Withdrawal declined. Offline limit is £%.2f.\n", available > 0 ? available : 0);
+                } else if (offlineRecord(dir, OFFLINE_WITHDRAW, card->id, amount) != 0) {
+                    printf("Transaction failed. Please try again.\n");
+                } else {
+                    card->balance -= amount;
+                    printf("Withdrawal accepted. It will be posted when the bank is reachable.\n");
+                }
+                break;
+            case 3:
+                printf("Enter amount to deposit:\n> ");
+                if (scanf("%lf", &amount) != 1) {
+                    printf("Invalid transaction.\n");
+                    skipLine();
+                    break;
+                }
+                if (amount <= 0) {
+                    printf("Invalid deposit amount.\n");
+                } else if (offlineRecord(dir, OFFLINE_DEPOSIT, card->id, amount) != 0) {
+                    printf("Transaction failed. Please try again.\n");
+                } else {
+                    printf("Deposit accepted. It will be posted when the bank is reachable.\n");
+                }
+                break;
+            case 7:
+                printf("Card ejected. Thank you!\n");
+                return;
+            default:
+                printf("Invalid option.\n");
+        }
+    }
 }
 
 void handleTransaction(Card *card) {
@@ -251,28 +6238,39 @@ void handleTransaction(Card *card) {
         showMenu();
         if (scanf("%d", &option) != 1) {
             printf("Invalid transaction.\n");
-            while (getchar() != '\n');
+            skipLine();
             continue;
         }
 
         switch (option) {
             case 1:
+                if (fetchCard(card->id, card) == 0) {
+                    printf("Transaction failed. Please try again.\n");
+                    break;
+                }
+                if (card->blocked) {
+                    printf("Card blocked. Contact the bank.\n");
+                    return;
+                }
                 printf("Your balance: £%.2f\n", card->balance);
                 break;
             case 2:
                 printf("Enter amount to withdraw (must be divisible by 5, 10, or 20):\n> ");
                 if (scanf("%lf", &amount) != 1) {
                     printf("Invalid transaction.\n");
-                    while (getchar() != '\n');
+                    skipLine();
                     continue;
                 }
                 withdrawMoney(card, amount);
+                if (card->blocked) {
+                    return;
+                }
                 break;
             case 3:
                 printf("Enter amount to deposit:\n> ");
                 if (scanf("%lf", &amount) != 1) {
                     printf("Invalid transaction.\n");
-                    while (getchar() != '\n');
+                    skipLine();
                     continue;
                 }
                 depositMoney(card, amount);
@@ -282,12 +6280,31 @@ void handleTransaction(Card *card) {
                 int newPin;
                 if (scanf("%d", &newPin) != 1) {
                     printf("Invalid transaction.\n");
-                    while (getchar() != '\n');
+                    skipLine();
                     continue;
                 }
                 updatePin(card->id, newPin);
                 break;
             case 5:
+                showMiniStatement(card);
+                break;
+            case 6:
+                printf("Enter recipient card ID:\n> ");
+                int toId;
+                if (scanf("%d", &toId) != 1) {
+                    printf("Invalid transaction.\n");
+                    skipLine();
+                    continue;
+                }
+                printf("Enter amount to transfer:\n> ");
+                if (scanf("%lf", &amount) != 1) {
+                    printf("Invalid transaction.\n");
+                    skipLine();
+                    continue;
+                }
+                transferMoney(card, toId, amount);
+                break;
+            case 7:
                 printf("Card ejected. Thank you!\n");
                 return;
             default:
@@ -301,45 +6318,62 @@ void showMenu() {
     printf("2. Withdraw Money\n");
     printf("3. Deposit Money\n");
     printf("4. Change PIN\n");
-    printf("5. Eject Card\n> ");
+    printf("5. Mini Statement\n");
+    printf("6. Transfer Money\n");
+    printf("7. Eject Card\n> ");
 }
 
 void test_withdrawMoney() {
-    Card testCard = {1, 1234, 100.0, 0, "Test User"};
+    Card testCard = {1, "1234", 100.0, 0, "Test User", 0};
     double amount = 10.0;
     assert(withdrawMoney(&testCard, amount) == 1);
     assert(testCard.balance == 90.0);
 }
 
 void test_depositMoney() {
-    Card testCard = {1, 1234, 100.0, 0, "Test User"};
+    Card testCard = {1, "1234", 100.0, 0, "Test User", 0};
     double amount = 20.0;
     assert(depositMoney(&testCard, amount) == 1);
     assert(testCard.balance == 120.0);
 }
 
 void test_check_balance() {
-    Card testCard = {1, 1234, 100.0, 0, "Test User"};
-    double expectedBalance = testCard.balance;
-    assert(testCard.balance == expectedBalance);
+    TerminalSession session = {.state = SESSION_MENU};
+    RequestView request = {0};
+    Card other;
+    double oldBalance;
+    assert(fetchCard(1, &session.card) == 1);
+    assert(fetchCard(1, &other) == 1);
+    assert(processCashRequest(&other, "Withdrawal", -20.0, newRequestId(), &oldBalance) == TX_OK); // Another terminal
+    request.op = OP_BALANCE;
+    request.cardId = 1;
+    assert(sessionHandleRequest(&session, &request) == STATUS_OK);
+    assert(session.card.balance == 80.0);
 }
 
 void test_updatePin() {
-    Card testCard = {1, 1234, 100.0, 0, "Test User"};
+    Card testCard = {1, "1234", 100.0, 0, "Test User", 0};
     int newPin = 5678;
     updatePin(testCard.id, newPin);
-    assert(testCard.pin == 5678);
+    assert(fetchCard(testCard.id, &testCard) == 1);
+    assert(!isLegacyPin(testCard.pinHash));
+    assert(verifyPin(NULL, testCard.id, testCard.pinHash, 5678) == 1);
+    assert(verifyPin(NULL, testCard.id, testCard.pinHash, 1234) == 0);
 }
 
 void test_blockCard() {
-    Card testCard = {1, 1234, 100.0, 0, "Test User"};
+    Card testCard = {1, "1234", 100.0, 0, "Test User", 0};
     blockCard(testCard.id);
+    assert(fetchCard(testCard.id, &testCard) == 1);
     assert(testCard.blocked == 1);
 }
 
 void test_unblockCard() {
-    Card testCard = {1, 1234, 100.0, 1, "Test User"};
-    contactBank(testCard.id); // Assuming contactBank successfully unblocks the card
+    Card testCard = {1, "1234", 100.0, 1, "Test User", 0};
+    blockCard(testCard.id);
+    assert(unblockCard(testCard.id, "Someone Else") == 0);
+    assert(unblockCard(testCard.id, testCard.ownerName) == 1);
+    assert(fetchCard(testCard.id, &testCard) == 1);
     assert(testCard.blocked == 0);
 }
 
@@ -362,28 +6396,813 @@ void test_isValidPin() {
     assert(isValidPin(0) == 1);     // Valid but weak
 }
 
-int main() {
-    // test_withdrawMoney();
-    // test_depositMoney();
-    // test_check_balance();
-    // test_updatePin();
-    // test_blockCard();
-    // test_unblockCard();
-    // test_fetchCard();
-    // test_isWeakPin();
-    // test_isValidPin();
+void test_fetchMiniStatement() {
+    Transaction transactions[2];
+    StatementCursor cursor = {0, 0};
+    recordTransaction(1, "Deposit", 10.0, 100.0, 110.0);
+    recordTransaction(1, "Withdrawal", -20.0, 110.0, 90.0);
+    recordTransaction(1, "Deposit", 5.0, 90.0, 95.0);
+    assert(fetchMiniStatement(1, &cursor, transactions, 2) == 2);
+    assert(transactions[0].newBalance == 95.0); // Newest first
+    assert(transactions[1].newBalance == 90.0);
+    assert(fetchMiniStatement(1, &cursor, transactions, 2) >= 1);
+    assert(transactions[0].newBalance == 110.0); // Continues after the cursor
+}
+
+void test_processCashRequest() {
+    Card testCard;
+    double oldBalance;
+    long long requestId = newRequestId();
+    assert(fetchCard(1, &testCard) == 1);
+    double startBalance = testCard.balance;
+    assert(processCashRequest(&testCard, "Deposit", 10.0, requestId, &oldBalance) == TX_OK);
+    assert(processCashRequest(&testCard, "Deposit", 10.0, requestId, &oldBalance) == TX_OK); // Retry
+    assert(oldBalance == startBalance);
+    assert(fetchCard(1, &testCard) == 1);
+    assert(testCard.balance == startBalance + 10.0); // Credited once
+
+    Card other;
+    assert(fetchCard(2, &other) == 1);
+    assert(processCashRequest(&other, "Withdrawal", -20.0, requestId, &oldBalance) == TX_OK); // Same id, other card
+    assert(oldBalance == 50.0 && other.balance == 30.0);
+    assert(processCashRequest(&testCard, "Withdrawal", -10.0, requestId, &oldBalance) == TX_INVALID);
+    assert(processCashRequest(&testCard, "Deposit", 20.0, requestId, &oldBalance) == TX_INVALID);
+    assert(testCard.balance == startBalance + 10.0);
+    memset(requestCache, 0, sizeof(requestCache)); // Same answers from ATM_Requests
+    assert(processCashRequest(&testCard, "Deposit", 20.0, requestId, &oldBalance) == TX_INVALID);
+    assert(processCashRequest(&testCard, "Deposit", 10.0, requestId, &oldBalance) == TX_OK);
+    assert(fetchCard(1, &testCard) == 1 && testCard.balance == startBalance + 10.0);
+}
+
+void test_parseRequest() {
+    const uint8_t frame[] = {
+        0, 0, 0, 24,                 // length
+        OP_WITHDRAW, 0, 0, 0,        // op, reserved
+        0, 0, 0, 1,                  // card id
+        0, 0, 0, 0, 0, 0, 0, 42,     // request id
+        0, 0, 0, 0, 0, 0, 0x07, 0xD0 // £20.00 in pence
+    };
+    RequestView request;
+    assert(parseRequest(frame, 3, &request) == 0);              // Incomplete header
+    assert(parseRequest(frame, sizeof(frame) - 1, &request) == 0); // Incomplete payload
+    assert(parseRequest(frame, sizeof(frame), &request) == sizeof(frame));
+    assert(request.op == OP_WITHDRAW);
+    assert(request.cardId == 1);
+    assert(request.requestId == 42);
+    assert(request.amountPence == 2000);
+    assert(request.payload == frame + 20); // Points into the buffer
+}
+
+void test_scoreWithdrawal() {
+    int cardId = 424242;
+    assert(scoreWithdrawal(cardId, 20.0, 1) == FRAUD_ALLOW);
+    recordWithdrawalFeatures(cardId, 20.0, 1);
+    recordWithdrawalFeatures(cardId, 20.0, 1);
+    recordWithdrawalFeatures(cardId, 20.0, 1);
+    assert(scoreWithdrawal(cardId, 20.0, 1) == FRAUD_DECLINE); // Fourth within a minute
+    recordWithdrawalFeatures(cardId + FRAUD_SLOTS, 20.0, 1); // Same chain, other card
+    assert(scoreWithdrawal(cardId, 20.0, 1) == FRAUD_DECLINE);
+    assert(scoreWithdrawal(cardId + 1, 5000.0, 1) == FRAUD_DECLINE); // Too much in an hour
+    for (int terminal = 2; terminal <= 5; terminal++) {
+        recordWithdrawalFeatures(cardId, 5.0, terminal);
+    }
+    assert(scoreWithdrawal(cardId, 5.0, 6) == FRAUD_BLOCK); // Sixth terminal in a day
+}
+
+void test_auditEvent() {
+    char dir[] = "/tmp/atm-audit-XXXXXX";
+    assert(crc32("123456789", 9) == 0xCBF43926);
+    assert(mkdtemp(dir) != NULL);
+    assert(auditOpen(dir) == 0);
+    auditEvent(1, AUDIT_WITHDRAW, 20.0, 80.0, TX_OK);
+    auditEvent(1, AUDIT_DEPOSIT, 5.0, 85.0, TX_OK);
+    auditClose();
+    assert(auditOpen(dir) == 0); // Reopening resumes after the last record
+    assert(auditLog.offset == 2 * sizeof(AuditRecord));
+    assert(auditLog.sequence == 2);
+    auditClose();
+    assert(dumpAuditLog(dir) == 0);
+}
+
+void test_transferFunds() {
+    Card from, to;
+    double oldBalance;
+    long long requestId = newRequestId();
+    assert(fetchCard(1, &from) == 1);
+    assert(fetchCard(2, &to) == 1);
+    double total = from.balance + to.balance;
+    double startBalance = from.balance;
+    assert(transferFunds(&from, 2, 5.0, requestId, &oldBalance) == TX_OK);
+    assert(transferFunds(&from, 2, 5.0, requestId, &oldBalance) == TX_OK); // Retry moves nothing
+    assert(transferFunds(&from, 2, from.balance + 1.0, newRequestId(), &oldBalance) == TX_DECLINED);
+    assert(fetchCard(1, &from) == 1);
+    assert(fetchCard(2, &to) == 1);
+    assert(from.balance + to.balance == total);
+    assert(from.balance == startBalance - 5.0);
+    assert(transferFunds(&from, 2, 5.0, newRequestId(), &oldBalance) == TX_OK);
+    assert(transferFunds(&from, 2, 5.0, newRequestId(), &oldBalance) == TX_OK);
+    assert(transferFunds(&from, 2, 5.0, newRequestId(), &oldBalance) == TX_DECLINED); // Velocity applies
+}
+
+void test_dispatchDueOrders() {
+    OrderHeap heap = {NULL, 0, 0, 0};
+    Card from;
+    long long now = (long long)time(NULL);
+    assert(fetchCard(1, &from) == 1);
+    int orderId = addStandingOrder(1, 2, 5.0, 3600, now - 10);
+    assert(orderId > 0);
+    assert(addStandingOrder(1, 2, 5.0, 3600, now + 600) > 0); // Not due yet
+    assert(loadStandingOrders(&heap) >= 2);
+    assert(dispatchDueOrders(&heap, now) >= 1);
+    assert(fetchCard(1, &from) == 1 && from.balance == 95.0);
+    assert(heap.entries[0].due > now); // Only future runs left
+    assert(dispatchDueOrders(&heap, now) == 0);
+    heapPush(&heap, now - 10, orderId); // A second scheduler's stale copy of the same run
+    assert(dispatchDueOrders(&heap, now) == 0);
+    assert(fetchCard(1, &from) == 1 && from.balance == 95.0);
+    Card to;
+    assert(fetchCard(2, &to) == 1 && to.balance == 55.0);
+    cancelStandingOrder(orderId);
+    free(heap.entries);
+}
+
+void test_searchOwners() {
+    Card card;
+    int cardIds[OWNER_SEARCH_LIMIT];
+    assert(fetchCard(1, &card) == 1);
+    char prefix[4] = {card.ownerName[0], card.ownerName[1], '\0'};
+    prefix[0] ^= 0x20; // Search is case-insensitive
+    int found = searchOwners(prefix, 0, cardIds, OWNER_SEARCH_LIMIT);
+    int hit = 0;
+    for (int i = 0; i < found; i++) {
+        hit |= cardIds[i] == 1;
+    }
+    assert(hit);
+    assert(searchOwners("\"*) OR", 0, cardIds, OWNER_SEARCH_LIMIT) >= 0); // Query syntax is not passed through
+    assert(searchOwners("secnod", 1, cardIds, OWNER_SEARCH_LIMIT) >= 1 && cardIds[0] == 2); // Transposed letters
+
+    // A query longer than the MATCH expression is refused, not truncated or overrun.
+    char longQuery[6000];
+    for (size_t i = 0; i + 1 < sizeof(longQuery); i++) {
+        longQuery[i] = i % 3 == 2 ? ' ' : 'a';
+    }
+    longQuery[sizeof(longQuery) - 1] = '\0';
+    assert(searchOwners(longQuery, 0, cardIds, OWNER_SEARCH_LIMIT) == -1);
+}
+
+void test_fetchCardStats() {
+    CardStats before, after;
+    Card card;
+    assert(fetchCard(1, &card) == 1);
+    assert(fetchCardStats(&before) == 1);
+    assert(depositMoney(&card, 10.0) == 1);
+    assert(fetchCardStats(&after) == 1);
+    assert(after.cards == before.cards);
+    assert(fabs(after.totalBalance - before.totalBalance - 10.0) < 0.001);
+    assert(fabs(after.deposits - before.deposits - 10.0) < 0.001);
+}
+
+void test_cardColumns() {
+    CardColumns columns;
+    CardStats stats;
+    Card card;
+    assert(cardColumnsLoad(&columns) > 0);
+    assert(fetchCardStats(&stats) == 1);
+    assert((long long)columns.count == stats.cards);
+    assert(cardColumnsCountBlocked(&columns) == (size_t)stats.blockedCards);
+    assert(llabs(cardColumnsSumBalances(&columns) - llround(stats.totalBalance * 100)) < 100);
+    assert(columns.ids[0] == 1 && fetchCard(1, &card) == 1);
+    assert(strcmp(cardColumnsName(&columns, 0), card.ownerName) == 0);
+    cardColumnsFree(&columns);
+}
+
+void test_admissionEnter() {
+    AdmissionStats before, after;
+    admissionSnapshot(&before);
+    assert(admissionEnter(ADMIT_CRITICAL) == 1);
+    assert(admissionEnter(ADMIT_CUSTOMER) == 0); // Writer stays busy past the wait limit
+    admissionLeave();
+    assert(admissionEnter(ADMIT_CUSTOMER) == 1);
+    admissionLeave();
+    admissionSnapshot(&after);
+    assert(after.shed[ADMIT_CUSTOMER] == before.shed[ADMIT_CUSTOMER] + 1);
+    assert(after.admitted[ADMIT_CUSTOMER] == before.admitted[ADMIT_CUSTOMER] + 1);
+    assert(after.waiting[ADMIT_CUSTOMER] == 0);
+}
+
+static long long standbyCount(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt;
+    long long value = -1;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+void test_standbyCatchUp() {
+    char dir[] = "/tmp/atm-standby-XXXXXX";
+    char path[64], file[80];
+    long long lagSeconds;
+    double oldBalance;
+    Card card;
+    assert(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/standby.db", dir);
+    sqlite3 *standby = openStandby(path);
+    assert(standby != NULL);
+    assert(standbyCatchUp(standby, &lagSeconds) > 0); // Seed
+    assert(standbyCount(standby, "SELECT COUNT(*) FROM main.ATM_Cards") == 2);
+
+    assert(fetchCard(1, &card) == 1);
+    assert(processCashRequest(&card, "Withdrawal", -20.0, newRequestId(), &oldBalance) == TX_OK);
+    assert(addStandingOrder(1, 2, 5.0, 3600, (long long)time(NULL) + 600) > 0);
+    sqlite3 *db = dbWriterAcquire();
+    sqlite3_exec(db, "UPDATE ATM_Cards SET failedAttempts = 2 WHERE id = 2; DELETE FROM ATM_Cards WHERE id = 2", 0, 0, 0);
+    dbWriterRelease();
+    assert(standbyCatchUp(standby, &lagSeconds) > 0);
+    assert(standbyCatchUp(standby, &lagSeconds) == 0);
+    assert(standbyCount(standby, "SELECT balance FROM main.ATM_Cards WHERE id = 1") == 80);
+    assert(standbyCount(standby, "SELECT COUNT(*) FROM main.ATM_Cards") == 1);
+    assert(standbyCount(standby, "SELECT COUNT(*) FROM main.ATM_Requests") == 1);
+    assert(standbyCount(standby, "SELECT COUNT(*) FROM main.ATM_Transactions") == 1);
+    assert(standbyCount(standby, "SELECT COUNT(*) FROM main.ATM_StandingOrders") == 1);
+    assert(standbyCount(standby, "SELECT totalBalance FROM main.ATM_Stats") == 80); // Derived on the standby
+
+    db = dbWriterAcquire(); // A trimmed log forces a reseed
+    sqlite3_exec(db, "UPDATE ATM_Cards SET failedAttempts = 1 WHERE id = 1; DELETE FROM ATM_ReplicaLog", 0, 0, 0);
+    sqlite3_exec(db, "UPDATE ATM_Cards SET balance = 75 WHERE id = 1", 0, 0, 0);
+    dbWriterRelease();
+    assert(standbyCatchUp(standby, &lagSeconds) > 0);
+    assert(standbyCount(standby, "SELECT failedAttempts * 100 + balance FROM main.ATM_Cards WHERE id = 1") == 175);
+    sqlite3_close(standby);
+
+    const char *suffixes[] = {"", "-wal", "-shm"};
+    for (int i = 0; i < 3; i++) {
+        snprintf(file, sizeof(file), "%s%s", path, suffixes[i]);
+        unlink(file);
+    }
+    rmdir(dir);
+}
+
+void test_runBackup() {
+    char dir[] = "/tmp/atm-backup-XXXXXX";
+    char path[64], tempPath[80];
+    assert(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/backup.db", dir);
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    assert(runBackup(path, BACKUP_STEP_PAGES, 0) == 0);
+    assert(verifyBackup(path) == 0);
+    assert(access(tempPath, F_OK) != 0);
+    unlink(path);
+    rmdir(dir);
+}
+
+void test_cdcOpen() {
+    char path[] = "/tmp/atm-cdc-XXXXXX";
+    char feed[1024] = "";
+    Card card;
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(cdcOpen(NULL, path) == 0);
+    assert(fetchCard(1, &card) == 1);
+    assert(depositMoney(&card, 10.0) == 1);
+    sqlite3 *db = dbWriterAcquire();
+    sqlite3_exec(db, "BEGIN; UPDATE ATM_Cards SET balance = 0 WHERE id = 2; ROLLBACK;", 0, 0, 0);
+    dbWriterRelease();
+    assert(read(fd, feed, sizeof(feed) - 1) > 0);
+    assert(strstr(feed, "\"card\":1,\"field\":\"balance\",\"old\":100,\"new\":110") != NULL);
+    assert(strstr(feed, "\"card\":2") == NULL); // Rolled back
+    close(fd);
+    unlink(path);
+}
+
+void test_offlineReplay() {
+    char dir[] = "/tmp/atm-offline-XXXXXX";
+    char path[64];
+    Card card;
+    assert(mkdtemp(dir) != NULL);
+    assert(storePin(2, 4826, NULL) == 1);
+    assert(offlineSaveSnapshot(dir) == 2);
+    struct stat info;
+    char snapshot[4096];
+    snprintf(path, sizeof(path), "%s/cards.snap", dir);
+    assert(stat(path, &info) == 0 && (info.st_mode & 0777) == 0600);
+    FILE *file = fopen(path, "rb");
+    size_t length = fread(snapshot, 1, sizeof(snapshot) - 1, file);
+    fclose(file);
+    assert(memmem(snapshot, length, "$pbkdf2", 7) == NULL); // Only a check value, never the hash
+    assert(offlineVerifyPin(dir, 2, 4826) == 1);
+    assert(offlineVerifyPin(dir, 1, 1234) == 0); // Plain PINs cannot be checked offline
+    assert(offlineFetchCard(dir, 1, &card) == 1 && card.balance == 100.0 && card.ownerName[0] == '\0');
+    assert(offlineFetchCard(dir, 3, &card) == 0);
+    assert(offlineRecord(dir, OFFLINE_WITHDRAW, 1, 20.0) == 0);
+    assert(offlineRecord(dir, OFFLINE_DEPOSIT, 2, 5.0) == 0);
+    assert(offlineWithdrawn(dir, 1) == 20.0 && offlineWithdrawn(dir, 2) == 0);
+    assert(offlineFetchCard(dir, 1, &card) == 1 && card.balance == 80.0);
+    assert(offlinePending(dir));
+    assert(offlineReplay(dir) == 0);
+    assert(!offlinePending(dir));
+    assert(fetchCard(1, &card) == 1 && fabs(card.balance - 80.0) < 0.001);
+    assert(fetchCard(2, &card) == 1 && fabs(card.balance - 55.0) < 0.001);
+    assert(offlineRecord(dir, OFFLINE_WITHDRAW, 2, 500.0) == 0);
+    assert(offlineReplay(dir) == 1); // The bank declines what the snapshot allowed
+    assert(fetchCard(2, &card) == 1 && fabs(card.balance - 55.0) < 0.001);
+    assert(offlineRecord(dir, OFFLINE_BLOCK, 1, 0) == 0);
+    assert(offlineFetchCard(dir, 1, &card) == 1 && card.blocked);
+    const char *files[] = {"cards.snap", "journal.log", "conflicts.log"};
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+void test_archiveLedger() {
+    char dir[] = "/tmp/atm-archive-XXXXXX";
+    char path[64];
+    Transaction transactions[MINI_STATEMENT_SIZE];
+    StatementCursor cursor = {0, 0};
+    Card card;
+    assert(mkdtemp(dir) != NULL);
+    sqlite3 *db = dbWriterAcquire();
+    sqlite3_exec(db, "INSERT INTO ATM_Transactions (cardId, terminalId, type, amount, oldBalance, newBalance, timestamp) "
+                     "VALUES (1, 1, 'Deposit', 10, 80, 90, 1579046400), (1, 1, 'Deposit', 10, 90, 100, 1581292800)", 0, 0, 0);
+    dbWriterRelease();
+    assert(fetchCard(1, &card) == 1);
+    assert(depositMoney(&card, 5.0) == 1);
+
+    assert(archiveLedger(dir, (long long)time(NULL) - 86400) == 2);
+    assert(archiveLedger(dir, (long long)time(NULL) - 86400) == 0);
+    snprintf(path, sizeof(path), "%s/ledger-2020-01.db", dir);
+    assert(access(path, F_OK) == 0);
+    assert(fetchMiniStatement(1, &cursor, transactions, 2) == 2); // Hot row, then February
+    assert(transactions[0].amount == 5.0 && transactions[1].timestamp == 1581292800);
+    assert(fetchMiniStatement(1, &cursor, transactions, 2) == 1);
+    assert(transactions[0].timestamp == 1579046400);
+    assert(fetchMiniStatement(1, &cursor, transactions, 2) == 0);
+
+    // A hot row reusing an archived id with different contents fails the copy
+    // instead of being dropped, and stays in the hot ledger.
+    sqlite3 *archive;
+    sqlite3_stmt *stmt;
+    assert(sqlite3_open_v2(path, &archive, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK);
+    assert(sqlite3_prepare_v2(archive, "SELECT MAX(id) FROM ATM_Transactions", -1, &stmt, 0) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    long long archivedId = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(archive);
+    db = dbWriterAcquire();
+    assert(sqlite3_prepare_v2(db, "INSERT INTO ATM_Transactions (id, cardId, terminalId, type, amount, oldBalance, newBalance, timestamp) "
+                                  "VALUES (?, 2, 1, 'Deposit', 7, 50, 57, 1579046400)", -1, &stmt, 0) == SQLITE_OK);
+    sqlite3_bind_int64(stmt, 1, archivedId);
+    assert(sqlite3_step(stmt) == SQLITE_DONE);
+    sqlite3_finalize(stmt);
+    dbWriterRelease();
+    assert(archiveLedger(dir, (long long)time(NULL) - 86400) == -1);
+    db = dbWriterAcquire();
+    sqlite3_exec(db, "DELETE FROM ATM_Transactions WHERE timestamp = 1579046400", 0, 0, 0);
+    assert(sqlite3_changes(db) == 1);
+    dbWriterRelease();
+
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/ledger-2020-02.db", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+void test_verifyPin() {
+    static const uint8_t expected[32] = {0x12, 0x0f, 0xb6, 0xcf, 0xfc, 0xf8, 0xb3, 0x2c, 0x43, 0xe7, 0x22, 0x52, 0x56, 0xc4, 0xf8, 0x37,
+                                         0xa8, 0x65, 0x48, 0xc9, 0x2c, 0xcc, 0x35, 0x48, 0x08, 0x05, 0x98, 0x7c, 0xb7, 0x0b, 0xe1, 0x7b};
+    uint8_t key[32];
+    Card card;
+    PinCache pins, otherPins;
+    memset(&pins, 0, sizeof(pins));
+    memset(&otherPins, 0, sizeof(otherPins));
+    pbkdf2Sha256("password", 8, (const uint8_t *)"salt", 4, 1, key); // RFC 7914 test vector
+    assert(memcmp(key, expected, sizeof(key)) == 0);
+
+    assert(fetchCard(1, &card) == 1 && isLegacyPin(card.pinHash));
+    assert(checkPin(&pins, &card, 1234) == 1 && !isLegacyPin(card.pinHash)); // Upgraded on login
+    assert(fetchCard(1, &card) == 1 && !isLegacyPin(card.pinHash));
+    assert(verifyPin(&pins, card.id, card.pinHash, 1234) == 1 && pins.hits == 1); // Cached by checkPin
+    assert(verifyPin(&pins, card.id, card.pinHash, 4321) == 0 && pins.misses == 1);
+    assert(verifyPin(&pins, 2, card.pinHash, 1234) == 1 && pins.misses == 2); // Cache entries are per card
+    assert(verifyPin(&otherPins, card.id, card.pinHash, 1234) == 1 && otherPins.hits == 0); // and per session
+
+    assert(migratePins(2) == 1);
+    assert(migratePins(2) == 0);
+    assert(fetchCard(2, &card) == 1 && !isLegacyPin(card.pinHash));
+    assert(verifyPin(NULL, card.id, card.pinHash, 5678) == 1);
+}
+
+void test_recordFailedPin() {
+    TerminalSession first, second;
+    RequestView request;
+    Card card;
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    memset(&request, 0, sizeof(request));
+    request.op = OP_AUTH;
+    request.cardId = 1;
+    request.pin = 1111;
+
+    assert(sessionHandleRequest(&first, &request) == STATUS_BAD_PIN);
+    assert(sessionHandleRequest(&first, &request) == STATUS_BAD_PIN);
+    assert(sessionHandleRequest(&second, &request) == STATUS_BLOCKED); // Third failure on another terminal
+    assert(fetchCard(1, &card) == 1 && card.blocked == 1 && card.failedAttempts == PIN_MAX_ATTEMPTS);
+    assert(unblockCard(1, card.ownerName) == 1);
+
+    assert(fetchCard(1, &card) == 1 && card.failedAttempts == 0);
+    assert(recordFailedPin(&card) == 1 && !card.blocked);
+    request.pin = 1234;
+    assert(sessionHandleRequest(&second, &request) == STATUS_OK);
+    assert(fetchCard(1, &card) == 1 && card.failedAttempts == 0); // A correct PIN resets the count
+
+    request.pin = 1111;
+    assert(sessionHandleRequest(&first, &request) == STATUS_BAD_PIN);
+    blockCard(1); // Blocked after the first terminal loaded the card
+    request.pin = 1234;
+    assert(sessionHandleRequest(&first, &request) == STATUS_BLOCKED && first.state == SESSION_CARD_ENTRY);
+    assert(fetchCard(1, &card) == 1 && card.blocked == 1 && card.failedAttempts == 1);
+
+    assert(unblockCard(1, card.ownerName) == 1);
+    memset(&first, 0, sizeof(first));
+    request.pin = 1111;
+    assert(sessionHandleRequest(&first, &request) == STATUS_BAD_PIN);
+    assert(storePin(1, 4321, NULL) == 1); // PIN changed after the first terminal loaded the card
+    request.pin = 1234;
+    assert(sessionHandleRequest(&first, &request) == STATUS_BAD_PIN);
+    request.pin = 4321;
+    assert(sessionHandleRequest(&first, &request) == STATUS_OK);
+    assert(fetchCard(1, &card) == 1 && card.failedAttempts == 0);
+}
+
+void test_migrateBaseline() {
+    char dir[] = "/tmp/atm-baseline-XXXXXX";
+    char path[64], file[80];
+    TerminalSession session;
+    RequestView request;
+    sqlite3 *db;
+    Card card;
+    assert(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/atm.db", dir);
+    assert(sqlite3_open(path, &db) == SQLITE_OK);
+    assert(sqlite3_exec(db, "CREATE TABLE ATM_Cards (id INTEGER PRIMARY KEY, pin INTEGER, balance REAL, "
+                            "blocked INTEGER, ownerName TEXT);"
+                            "INSERT INTO ATM_Cards VALUES (1, 1234, 100.0, 0, 'Test User'), (2, 5678, 50.0, 0, 'Second User')",
+                        0, 0, 0) == SQLITE_OK);
+    sqlite3_close(db);
+
+    closeDatabasePool();
+    setDatabasePath(path);
+    initializeDatabase();
+    assert(fetchCard(1, &card) == 1 && card.balance == 100.0 && card.failedAttempts == 0);
+    assert(fetchCard(2, &card) == 1 && strcmp(card.ownerName, "Second User") == 0);
+    memset(&session, 0, sizeof(session));
+    memset(&request, 0, sizeof(request));
+    request.op = OP_AUTH;
+    request.cardId = 1;
+    request.pin = 1111;
+    assert(sessionHandleRequest(&session, &request) == STATUS_BAD_PIN);
+    request.pin = 1234;
+    assert(sessionHandleRequest(&session, &request) == STATUS_OK);
+    closeDatabasePool();
+
+    const char *suffixes[] = {"", "-wal", "-shm"};
+    for (int i = 0; i < 3; i++) {
+        snprintf(file, sizeof(file), "%s%s", path, suffixes[i]);
+        unlink(file);
+    }
+    rmdir(dir);
+}
+
+void test_terminalTotals() {
+    ReconcileResult worker = {0}, total = {0};
+    for (long long id = 0; id < 1000; id++) { // Grows the table well past its first size
+        TerminalTotals tx = {id * 70, id, 0, 1};
+        assert(addTerminalTotals(&worker, &tx) == 0);
+    }
+    TerminalTotals other = {70000, 0, 5.0, 2};
+    assert(addTerminalTotals(&worker, &other) == 0);
+    assert(addTerminalTotals(&total, &other) == 0);
+    for (size_t i = 0; i < worker.terminalSlots; i++) {
+        if (worker.terminals[i].count != 0) {
+            assert(addTerminalTotals(&total, &worker.terminals[i]) == 0);
+        }
+    }
+    assert(total.terminalCount == 1001);
+    TerminalTotals *t = terminalTotals(&total, 70000);
+    assert(t->count == 4 && t->withdrawals == 10.0 && t->deposits == 0);
+    t = terminalTotals(&total, 255 * 70);
+    assert(t->count == 1 && t->deposits == 255.0);
+    free(worker.terminals);
+    free(total.terminals);
+}
+
+void test_runMaintenance() {
+    long long now = (long long)time(NULL);
+    sqlite3 *db = dbWriterAcquire();
+    char sql[300];
+    snprintf(sql, sizeof(sql), "INSERT INTO ATM_Requests (requestId, cardId, type, amount, result, oldBalance, newBalance, timestamp) "
+                               "VALUES (7, 1, 'Deposit', 5, 0, 100, 105, %lld), (9, 1, 'Deposit', 5, 0, 105, 110, %lld)",
+             now - DEDUPE_WINDOW - 1, now);
+    assert(sqlite3_exec(db, sql, 0, 0, 0) == SQLITE_OK);
+    dbWriterRelease();
+
+    assert(runMaintenance(now) == 1); // Only the expired entry, whatever its request id
+    assert(runMaintenance(now) == 0);
+    RequestRecord record;
+    assert(lookupStoredRequest(dbReader(), 1, 9, &record) == 1 && record.newBalance == 110);
+    assert(lookupStoredRequest(dbReader(), 1, 7, &record) == 0);
+
+    db = dbWriterAcquire(); // Card changes alone fill both logs
+    assert(sqlite3_exec(db, "UPDATE ATM_Cards SET failedAttempts = 1 WHERE id = 2", 0, 0, 0) == SQLITE_OK);
+    dbWriterRelease();
+    assert(runMaintenance(now) == 0);
+    assert(runMaintenance(now + CHANGELOG_RETENTION + 1) >= 2);
+    assert(standbyCount(dbReader(), "SELECT COUNT(*) FROM ATM_ChangeLog") == 0);
+    assert(standbyCount(dbReader(), "SELECT COUNT(*) FROM ATM_ReplicaLog") == 0);
+}
+
+// Test runner. Each test runs in its own child process against a fresh shared
+// in-memory database seeded with two cards, so tests cannot see each other's
+// data, never touch atm.db, and one failing assert does not stop the rest.
+typedef struct {
+    const char *name;
+    void (*run)();
+} TestCase;
+
+static const TestCase testCases[] = {
+    {"withdrawMoney", test_withdrawMoney},
+    {"depositMoney", test_depositMoney},
+    {"check_balance", test_check_balance},
+    {"updatePin", test_updatePin},
+    {"blockCard", test_blockCard},
+    {"unblockCard", test_unblockCard},
+    {"fetchCard", test_fetchCard},
+    {"isWeakPin", test_isWeakPin},
+    {"isValidPin", test_isValidPin},
+    {"fetchMiniStatement", test_fetchMiniStatement},
+    {"processCashRequest", test_processCashRequest},
+    {"parseRequest", test_parseRequest},
+    {"scoreWithdrawal", test_scoreWithdrawal},
+    {"auditEvent", test_auditEvent},
+    {"transferFunds", test_transferFunds},
+    {"dispatchDueOrders", test_dispatchDueOrders},
+    {"searchOwners", test_searchOwners},
+    {"fetchCardStats", test_fetchCardStats},
+    {"cardColumns", test_cardColumns},
+    {"admissionEnter", test_admissionEnter},
+    {"standbyCatchUp", test_standbyCatchUp},
+    {"runBackup", test_runBackup},
+    {"cdcOpen", test_cdcOpen},
+    {"offlineReplay", test_offlineReplay},
+    {"archiveLedger", test_archiveLedger},
+    {"verifyPin", test_verifyPin},
+    {"recordFailedPin", test_recordFailedPin},
+    {"migrateBaseline", test_migrateBaseline},
+    {"terminalTotals", test_terminalTotals},
+    {"runMaintenance", test_runMaintenance},
+};
+
+static void seedTestFixture() {
+    sqlite3 *db = dbWriterAcquire();
+
+    assert(db != NULL);
+    sqlite3_exec(db, "INSERT INTO ATM_Cards (id, pinHash, balance, blocked, ownerName) VALUES "
+                     "(1, 1234, 100.0, 0, 'Test User'), (2, 5678, 50.0, 0, 'Second User')", 0, 0, 0);
+    dbWriterRelease();
+}
+
+int runTests(int count, char *names[]) {
+    int passed = 0, failed = 0;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < sizeof(testCases) / sizeof(testCases[0]); i++) {
+        int selected = count == 0;
+        for (int j = 0; j < count; j++) {
+            selected |= strcmp(names[j], testCases[i].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            // Prompts read end of input and answer "no"; output is only kept for
+            // failures, which assert reports on stderr.
+            freopen("/dev/null", "r", stdin);
+            freopen("/dev/null", "w", stdout);
+            setDatabasePath(":memory:");
+            initializeDatabase();
+            seedTestFixture();
+            testCases[i].run();
+            closeDatabasePool();
+            exit(0);
+        }
+
+        int status = 0;
+        waitpid(child, &status, 0);
+        if (child > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            printf("PASS %s\n", testCases[i].name);
+            passed++;
+        } else {
+            printf("FAIL %s\n", testCases[i].name);
+            failed++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d passed, %d failed in %.3fs\n", passed, failed, seconds);
+    return failed == 0 && passed > 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = getenv("ATM_DB");
+    if (getenv("ATM_TERMINAL_ID") != NULL) {
+        terminalId = atoi(getenv("ATM_TERMINAL_ID"));
+    }
+    if (argc > 2 && strcmp(argv[1], "--db") == 0) {
+        path = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (path != NULL) {
+        setDatabasePath(path);
+    }
+    if (argc > 1 && strcmp(argv[1], "--test") == 0) {
+        return runTests(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "audit-dump") == 0) {
+        const char *dir = argc > 2 ? argv[2] : getenv("ATM_AUDIT_DIR");
+        return dumpAuditLog(dir != NULL ? dir : AUDIT_DIR);
+    }
+    if (argc > 2 && strcmp(argv[1], "cdc-tail") == 0) {
+        return runCdcTail(argv[2]);
+    }
+    if (getenv("ATM_AUDIT_DIR") != NULL) {
+        auditOpen(getenv("ATM_AUDIT_DIR"));
+        atexit(auditClose);
+    }
+    if ((getenv("ATM_CDC_SOCKET") != NULL || getenv("ATM_CDC_FILE") != NULL) &&
+        cdcOpen(getenv("ATM_CDC_SOCKET"), getenv("ATM_CDC_FILE")) != 0) {
+        return 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "reconcile") == 0) {
+        int threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        initializeDatabase();
+        int discrepancies = runReconciliation(threads);
+        closeDatabasePool();
+        return discrepancies == 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        initializeDatabase();
+        int result = runBenchmark(argc > 2 ? atoi(argv[2]) : 10000);
+        closeDatabasePool();
+        return result;
+    }
+    if (argc > 1 && strcmp(argv[1], "standby") == 0) {
+        initializeDatabase();
+        return runStandby(argc > 2 ? argv[2] : STANDBY_PATH, argc > 3 ? atoi(argv[3]) : 100);
+    }
+    if (argc > 1 && strcmp(argv[1], "promote") == 0) {
+        return promoteStandby(argc > 2 ? argv[2] : STANDBY_PATH);
+    }
+    if (argc > 1 && strcmp(argv[1], "accrue") == 0) {
+        if (argc < 4) {
+            printf("Usage: %s accrue <job-name> <rate-percent> [threads]\n", argv[0]);
+            return 1;
+        }
+        initializeDatabase();
+        int threads = argc > 4 ? atoi(argv[4]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        int result = runAccrual(argv[2], atof(argv[3]), threads);
+        closeDatabasePool();
+        return result;
+    }
+    if (argc > 1 && strcmp(argv[1], "order-add") == 0) {
+        if (argc < 6) {
+            printf("Usage: %s order-add <from-card> <to-card> <amount> <interval-seconds> [first-run]\n", argv[0]);
+            return 1;
+        }
+        initializeDatabase();
+        long long firstRun = argc > 6 ? atoll(argv[6]) : (long long)time(NULL);
+        int orderId = addStandingOrder(atoi(argv[2]), atoi(argv[3]), atof(argv[4]), atoi(argv[5]), firstRun);
+        closeDatabasePool();
+        printf(orderId > 0 ? "Standing order %d created.\n" : "Error creating standing order.\n", orderId);
+        return orderId > 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "order-cancel") == 0 && argc > 2) {
+        initializeDatabase();
+        cancelStandingOrder(atoi(argv[2]));
+        closeDatabasePool();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "scheduler") == 0) {
+        initializeDatabase();
+        terminalId = 0;
+        return runScheduler(argc > 2 ? atoi(argv[2]) : 60);
+    }
+    if (argc > 1 && strcmp(argv[1], "search") == 0) {
+        int fuzzy = argc > 2 && strcmp(argv[2], "--fuzzy") == 0;
+        if (argc < 3 + fuzzy) {
+            printf("Usage: %s search [--fuzzy] <name>\n", argv[0]);
+            return 1;
+        }
+        initializeDatabase();
+        int status = runOwnerSearch(argv[2 + fuzzy], fuzzy);
+        closeDatabasePool();
+        return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "stats") == 0) {
+        initializeDatabase();
+        int status = runStats(argc > 2 ? atoi(argv[2]) : 10);
+        closeDatabasePool();
+        return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "scan") == 0) {
+        initializeDatabase();
+        int status = runCardScan();
+        closeDatabasePool();
+        return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "backup") == 0) {
+        if (argc < 3) {
+            printf("Usage: %s backup <destination> [pages-per-step] [pause-ms]\n", argv[0]);
+            return 1;
+        }
+        initializeDatabase();
+        int status = runBackup(argv[2], argc > 3 ? atoi(argv[3]) : BACKUP_STEP_PAGES, argc > 4 ? atoi(argv[4]) : BACKUP_PAUSE_MS);
+        closeDatabasePool();
+        return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "archive") == 0) {
+        const char *dir = argc > 3 ? argv[3] : getenv("ATM_ARCHIVE_DIR");
+        initializeDatabase();
+        int status = runArchive(dir != NULL ? dir : ARCHIVE_DIR, argc > 2 ? atoi(argv[2]) : ARCHIVE_KEEP_DAYS);
+        closeDatabasePool();
+        return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "migrate-pins") == 0) {
+        int threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        initializeDatabase();
+        long migrated = migratePins(threads);
+        closeDatabasePool();
+        printf(migrated >= 0 ? "Hashed %ld PIN(s).\n" : "Error migrating PINs.\n", migrated);
+        return migrated >= 0 ? 0 : 1;
+    }
+    if (argc > 2 && strcmp(argv[1], "verify-backup") == 0) {
+        return verifyBackup(argv[2]);
+    }
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        initializeDatabase();
+        loadFraudRules(FRAUD_RULES_FILE);
+        return runTerminalServer(argc > 2 ? argv[2] : SOCKET_PATH, argc > 3 ? atoi(argv[3]) : 1);
+    }
+
+    const char *offlineDir = getenv("ATM_OFFLINE_DIR");
+    if (argc > 1 && strcmp(argv[1], "offline-snapshot") == 0) {
+        if (offlineDir == NULL) {
+            printf("Set ATM_OFFLINE_DIR to the terminal's offline directory.\n");
+            return 1;
+        }
+        initializeDatabase();
+        int count = offlineSaveSnapshot(offlineDir);
+        closeDatabasePool();
+        printf(count >= 0 ? "Saved %d card(s) to the offline snapshot.\n" : "Error saving offline snapshot.\n", count);
+        return count >= 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "offline-replay") == 0) {
+        if (offlineDir == NULL) {
+            printf("Set ATM_OFFLINE_DIR to the terminal's offline directory.\n");
+            return 1;
+        }
+        initializeDatabase();
+        int conflicts = offlineReplay(offlineDir);
+        closeDatabasePool();
+        return conflicts == 0 ? 0 : 1;
+    }
 
-    printf("All tests passed successfully!\n");
     initializeDatabase();
+    loadFraudRules(FRAUD_RULES_FILE);
+    if (offlineDir != NULL && databaseAvailable()) {
+        offlineReplay(offlineDir);
+        offlineSaveSnapshot(offlineDir);
+    }
 
-    int cardId, enteredPin, attempts;
+    int cardId, enteredPin, attempts, offline;
     Card currentCard;
+    PinCache consolePins;
 
+    memset(&consolePins, 0, sizeof(consolePins));
     while (1) {
         printf("\nEnter Card ID (1 or 2, 0 to Exit):\n> ");
         if (scanf("%d", &cardId) != 1) {
             printf("Invalid transaction.\n");
-            while (getchar() != '\n');
+            skipLine();
             continue;
         }
 
@@ -393,39 +7212,78 @@ int main() {
             continue;
         }
 
+        offline = 0;
+        if (offlineDir != NULL && offlinePending(offlineDir) && databaseAvailable()) {
+            offlineReplay(offlineDir);
+        }
         if (fetchCard(cardId, &currentCard) == 0) {
-            printf("Card not found.\n");
-            continue;
+            if (offlineDir == NULL || databaseAvailable() || !offlineFetchCard(offlineDir, cardId, &currentCard)) {
+                printf("Card not found.\n");
+                continue;
+            }
+            offline = 1;
         }
 
         if (currentCard.blocked) {
             printf("Card is blocked. Contact the bank.\n");
-            contactBank(cardId);
+            if (!offline) {
+                contactBank(cardId);
+            }
             continue;
         }
 
-        attempts = 0;
-        while (attempts < 3) {
+        if (!offline) {
+            maintainIfDue();
+        }
+        attempts = currentCard.failedAttempts;
+        while (attempts < PIN_MAX_ATTEMPTS && !currentCard.blocked) {
             printf("Enter PIN:\n> ");
             if (scanf("%d", &enteredPin) != 1) {
                 printf("Invalid transaction.\n");
-                while (getchar() != '\n');
+                skipLine();
                 continue;
             }
 
-            if (enteredPin == currentCard.pin) {
-                handleTransaction(&currentCard);
+            if (offline ? offlineVerifyPin(offlineDir, cardId, enteredPin) : checkPin(&consolePins, &currentCard, enteredPin)) {
+                int accepted = offline ? 1 : acceptPin(&currentCard);
+                if (accepted < 0) {
+                    printf("Transaction failed. Please try again.\n");
+                    break;
+                }
+                auditEvent(cardId, AUDIT_AUTH, 0, currentCard.balance, accepted);
+                if (currentCard.blocked) {
+                    break;
+                }
+                if (accepted == 0) { // The PIN was changed meanwhile
+                    attempts = currentCard.failedAttempts;
+                    printf("Incorrect PIN. Attempts left: %d\n", PIN_MAX_ATTEMPTS - attempts);
+                    continue;
+                }
+                if (offline) {
+                    handleOfflineTransaction(&currentCard, offlineDir);
+                } else {
+                    handleTransaction(&currentCard);
+                }
+                break;
+            }
+            auditEvent(cardId, AUDIT_AUTH, 0, currentCard.balance, 0);
+            // Offline, the count cannot be stored; a block is journaled instead below.
+            attempts = offline ? attempts + 1 : recordFailedPin(&currentCard);
+            if (attempts < 0) {
+                printf("Transaction failed. Please try again.\n");
                 break;
             }
-            printf("Incorrect PIN. Attempts left: %d\n", 2 - attempts);
-            attempts++;
+            printf("Incorrect PIN. Attempts left: %d\n", attempts < PIN_MAX_ATTEMPTS ? PIN_MAX_ATTEMPTS - attempts : 0);
         }
 
-        if (attempts == 3) {
+        if (attempts >= PIN_MAX_ATTEMPTS || currentCard.blocked) {
             printf("Card blocked. Contact the bank.\n");
-            blockCard(cardId);
+            if (offline) {
+                offlineRecord(offlineDir, OFFLINE_BLOCK, cardId, 0);
+            }
         }
     }
 
+    closeDatabasePool();
     return 0;
 }
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Builds the debug, release (LTO) and PGO + LTO binaries, trains the PGO build on
+# the scripted session workload and prints the throughput of each.
+# Usage: scripts/pgo.sh [sessions]
+set -e
+
+cd "$(dirname "$0")/.."
+SESSIONS=${1:-20000}
+BINARY=Programing_Assigment
+
+bench() {
+    dir=$(mktemp -d)
+    (cd "$dir" && "$OLDPWD/build/$1/$BINARY" bench "$SESSIONS")
+    rm -rf "$dir"
+}
+
+cmake --preset debug >/dev/null && cmake --build --preset debug
+cmake --preset release >/dev/null && cmake --build --preset release
+
+rm -rf build/pgo/pgo-profile
+cmake --preset pgo-generate >/dev/null && cmake --build --preset pgo-generate
+bench pgo >/dev/null
+if ls build/pgo/pgo-profile/*.profraw >/dev/null 2>&1; then
+    llvm-profdata merge -output=build/pgo/pgo-profile/default.profdata build/pgo/pgo-profile/*.profraw
+fi
+cmake --preset pgo-use >/dev/null && cmake --build --preset pgo-use
+
+for build in debug release pgo; do
+    printf '%-8s ' "$build:"
+    bench "$build"
+done